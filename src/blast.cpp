@@ -9,6 +9,7 @@
 #include "matrix.h"
 #include "utils.h"
 #include "progress.h"
+#include "scheduler.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/detail/atomic_count.hpp>
@@ -1170,11 +1171,13 @@ struct Hit
   std::string mDefLine;
   sequence mTarget;
   std::vector<Hsp> mHsps;
+  uint64 mSampleKey;
 };
 
 Hit::Hit(const char* inEntry, const sequence& inTarget)
   : mDefLine(inEntry, const_cast<const char*>(strchr(inEntry, '\n'))),
-    mTarget(inTarget)
+    mTarget(inTarget),
+    mSampleKey(0)
 {
 }
 
@@ -1229,6 +1232,82 @@ void Hit::Cleanup(int64 inSearchSpace, double inLambda, double inLogKappa,
     mHsps.end());
 }
 
+// split a FastA file at record boundaries, at most one part per thread
+static std::vector<std::pair<const char*, size_t>> SplitDatabank(
+  const char* inData, size_t inLength, uint32 inParts)
+{
+  std::vector<std::pair<const char*, size_t>> parts;
+
+  size_t k = inLength / inParts;
+  while (parts.size() < inParts and inLength > 0)
+  {
+    size_t n = k;
+    if (n > inLength)
+      n = inLength;
+    const char* end = inData + n;
+    while (n < inLength and *end != '>')
+      ++end, ++n;
+
+    parts.push_back(std::make_pair(inData, n));
+
+    inData += n;
+    inLength -= n;
+  }
+
+  return parts;
+}
+
+// count the entries and residues the way SearchPart does
+static void CountEntries(const char* inFasta, size_t inLength,
+                         uint32& outDbCount, int64& outDbLength)
+{
+  const char* end = inFasta + inLength;
+  sequence target;
+  target.reserve(kMaxSequenceLength);
+
+  while (inFasta != end)
+  {
+    ReadEntry(inFasta, end, target);
+
+    if (target.empty() or target.length() > kMaxSequenceLength)
+      continue;
+
+    outDbCount += 1;
+    outDbLength += target.length();
+  }
+}
+
+// --------------------------------------------------------------------
+// Sampling hits: every hit gets a pseudo random key computed from its FastA
+// header and the seed, and the hits with the lowest keys are kept. This is
+// a reservoir sample that does not depend on the order in which the hits are
+// found, so the result is the same for any number of threads.
+
+static uint64 Mix(uint64 inValue)
+{
+  // the splitmix64 finaliser
+  inValue += 0x9e3779b97f4a7c15ULL;
+  inValue = (inValue ^ (inValue >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  inValue = (inValue ^ (inValue >> 27)) * 0x94d049bb133111ebULL;
+  return inValue ^ (inValue >> 31);
+}
+
+static uint64 SampleKey(const std::string& inDefLine, uint32 inSeed)
+{
+  // FNV-1a, stable across platforms and library versions
+  uint64 h = 14695981039346656037ULL;
+  foreach (char ch, inDefLine)
+    h = (h ^ static_cast<uint8>(ch)) * 1099511628211ULL;
+
+  return Mix(h ^ Mix(inSeed));
+}
+
+static bool SampleOrder(const HitPtr a, const HitPtr b)
+{
+  return a->mSampleKey < b->mSampleKey or
+         (a->mSampleKey == b->mSampleKey and a->mDefLine < b->mDefLine);
+}
+
 // --------------------------------------------------------------------
 
 template<int WORDSIZE>
@@ -1237,17 +1316,23 @@ class BlastQuery
   public:
     BlastQuery(const std::string& inQuery, bool inFilter, double inExpect,
                const std::string& inMatrix, bool inGapped, int32 inGapOpen,
-               int32 inGapExtend, uint32 inReportLimit);
+               int32 inGapExtend, uint32 inReportLimit, uint32 inSampleSize,
+               uint32 inSeed);
     ~BlastQuery();
 
     void Search(const std::vector<fs::path>& inDatabanks,
-                MProgress& inProgress, uint32 inNrOfThreads);
+                MProgress& inProgress, MScheduler& inScheduler);
     void WriteAsFasta(std::ostream& inStream);
+    void GetHits(std::vector<BlastHit>& outHits);
+
+    // true if more hits passed the expect value cut off than the sample size
+    bool Sampled() const { return mSampleSize > 0 and mHitCount > mSampleSize; }
 
   private:
     void SearchPart(const char* inFasta, size_t inLength,
                     MProgress& inProgress, uint32& outDbCount,
-                    int64& outDbLength, std::vector<HitPtr>& outHits) const;
+                    int64& outDbLength, uint64& outHitCount,
+                    std::vector<HitPtr>& outHits) const;
 
     int32 Extend(int32& ioQueryStart, const sequence& inTarget,
                       int32& ioTargetStart, int32& ioDistance) const;
@@ -1260,7 +1345,12 @@ class BlastQuery
     int32 AlignGappedFirst(const sequence& inTarget, Hsp& ioHsp) const;
     int32 AlignGappedSecond(const sequence& inTarget, Hsp& ioHsp) const;
 
-    void AddHit(HitPtr inHit, std::vector<HitPtr>& inHitList) const;
+    int64 SearchSpace(uint32 inDbCount, int64 inDbLength) const;
+    void FinishHit(Hit& ioHit) const;
+
+    void AddHit(HitPtr inHit, std::vector<HitPtr>& inHitList,
+                uint64& ioHitCount) const;
+    void TrimSample();
 
     typedef WordHitIterator<WORDSIZE> IWordHitIterator;
     typedef typename IWordHitIterator::WordHitIteratorStaticData StaticData;
@@ -1277,8 +1367,11 @@ class BlastQuery
     int32 mXg;
     int32 mXgFinal;
     uint32 mReportLimit;
+    uint32 mSampleSize;
+    uint32 mSeed;
 
     uint32 mDbCount;
+    uint64 mHitCount;
     int64 mDbLength;
     int64 mSearchSpace;
 
@@ -1291,13 +1384,17 @@ template<int WORDSIZE>
 BlastQuery<WORDSIZE>::BlastQuery(const std::string& inQuery, bool inFilter,
                                  double inExpect, const std::string& inMatrix,
                                  bool inGapped, int32 inGapOpen,
-                                 int32 inGapExtend, uint32 inReportLimit)
+                                 int32 inGapExtend, uint32 inReportLimit,
+                                 uint32 inSampleSize, uint32 inSeed)
   : mUnfiltered(inQuery),
     mMatrix(inMatrix, inGapOpen, inGapExtend),
     mExpect(inExpect),
     mGapped(inGapped),
     mReportLimit(inReportLimit),
+    mSampleSize(inSampleSize),
+    mSeed(inSeed),
     mDbCount(0),
+    mHitCount(0),
     mDbLength(0),
     mSearchSpace(0),
     mCutOff(0)
@@ -1305,6 +1402,9 @@ BlastQuery<WORDSIZE>::BlastQuery(const std::string& inQuery, bool inFilter,
   if (mQuery.length() >= kMaxSequenceLength)
     throw mas_exception("Query length exceeds maximum");
 
+  if (mReportLimit > 0 and mSampleSize > 0)
+    throw mas_exception("A report limit and a sample size cannot be combined");
+
   mUnfiltered.erase(remove_if(mUnfiltered.begin(),
                               mUnfiltered.end(), [](char aa) -> bool {
     return ResidueNr(aa) >= kResCount;
@@ -1342,8 +1442,42 @@ BlastQuery<WORDSIZE>::~BlastQuery()
 
 template<int WORDSIZE>
 void BlastQuery<WORDSIZE>::Search(const std::vector<fs::path>& inDatabanks,
-                                  MProgress& inProgress, uint32 inNrOfThreads)
+                                  MProgress& inProgress,
+                                  MScheduler& inScheduler)
 {
+  // A sample should only contain hits that pass the expect value cut off.
+  // That cut off depends on the size of all databanks, so count these first.
+  if (mSampleSize > 0)
+  {
+    uint32 dbCount = 0;
+    int64 dbLength = 0;
+
+    foreach (const fs::path& p, inDatabanks)
+    {
+      io::mapped_file file(p.string().c_str(), io::mapped_file::readonly);
+      if (not file.is_open())
+        throw mas_exception(boost::format("FastA file %s not open") % p);
+
+      auto parts = SplitDatabank(file.const_data(), file.size(),
+                                 inScheduler.Size());
+
+      boost::mutex m;
+
+      inScheduler.Run(static_cast<uint32>(parts.size()), [&](uint32 i) {
+        uint32 n = 0;
+        int64 l = 0;
+
+        CountEntries(parts[i].first, parts[i].second, n, l);
+
+        boost::mutex::scoped_lock lock(m);
+        dbCount += n;
+        dbLength += l;
+      });
+    }
+
+    mSearchSpace = SearchSpace(dbCount, dbLength);
+  }
+
   foreach (const fs::path& p, inDatabanks)
   {
     io::mapped_file file(p.string().c_str(), io::mapped_file::readonly);
@@ -1353,79 +1487,54 @@ void BlastQuery<WORDSIZE>::Search(const std::vector<fs::path>& inDatabanks,
     const char* data = file.const_data();
     size_t length = file.size();
 
-    if (inNrOfThreads <= 1)
-      SearchPart(data, length, inProgress, mDbCount, mDbLength, mHits);
+    if (inScheduler.Size() <= 1)
+      SearchPart(data, length, inProgress, mDbCount, mDbLength, mHitCount,
+                 mHits);
     else
     {
-      boost::thread_group t;
+      auto parts = SplitDatabank(data, length, inScheduler.Size());
+
       boost::mutex m;
 
-      size_t k = length / inNrOfThreads;
-      for (uint32 i = 0; i < inNrOfThreads and length > 0; ++i)
-      {
-        size_t n = k;
-        if (n > length)
-          n = length;
-        const char* end = data + n;
-        while (n < length and *end != '>')
-          ++end, ++n;
-
-        t.create_thread([data, n, &m, &inProgress, this]() {
-          uint32 dbCount = 0;
-          int64 dbLength = 0;
-          std::vector<HitPtr> hits;
-
-          this->SearchPart(data, n, inProgress, dbCount, dbLength, hits);
-
-          boost::mutex::scoped_lock lock(m);
-          mDbCount += dbCount;
-          mDbLength += dbLength;
-          this->mHits.insert(mHits.end(), hits.begin(), hits.end());
-        });
-
-        data += n;
-        length -= n;
-      }
+      inScheduler.Run(static_cast<uint32>(parts.size()), [&](uint32 i) {
+        uint32 dbCount = 0;
+        int64 dbLength = 0;
+        uint64 hitCount = 0;
+        std::vector<HitPtr> hits;
 
-      t.join_all();
-    }
-  }
+        this->SearchPart(parts[i].first, parts[i].second, inProgress, dbCount,
+                         dbLength, hitCount, hits);
 
-  int32 lengthAdjustment = ncbi::BlastComputeLengthAdjustment(
-      mMatrix, static_cast<uint32>(mQuery.length()), mDbLength, mDbCount);
+        boost::mutex::scoped_lock lock(m);
+        mDbCount += dbCount;
+        mDbLength += dbLength;
+        mHitCount += hitCount;
+        this->mHits.insert(mHits.end(), hits.begin(), hits.end());
+      });
 
-  int64 effectiveQueryLength = mQuery.length() - lengthAdjustment;
-  int64 effectiveDbLength = mDbLength - mDbCount * lengthAdjustment;
+      // each part kept its own sample, keep the best of these
+      if (mSampleSize > 0)
+        TrimSample();
+    }
+  }
 
-  mSearchSpace = effectiveDbLength * effectiveQueryLength;
+  mSearchSpace = SearchSpace(mDbCount, mDbLength);
 
-  if (not mHits.empty())
+  // sampled hits were finished while searching
+  if (not mHits.empty() and mSampleSize == 0)
   {
-    boost::thread_group t;
     boost::detail::atomic_count ix(-1);
 
-    for (uint32 i = 0; i < inNrOfThreads; ++i)
-    {
-      t.create_thread([this, &ix]() {
-        double lambda = mMatrix.GappedLambda();
-        double logK = log(mMatrix.GappedKappa());
-
-        for (;;)
-        {
-          uint32 next = ++ix;
-          if (next >= mHits.size())
-            break;
-
-          HitPtr hit = mHits[next];
-
-          foreach (Hsp& hsp, hit->mHsps)
-            hsp.mScore = this->AlignGappedSecond(hit->mTarget, hsp);
+    inScheduler.Run(inScheduler.Size(), [this, &ix](uint32) {
+      for (;;)
+      {
+        uint32 next = ++ix;
+        if (next >= mHits.size())
+          break;
 
-          hit->Cleanup(mSearchSpace, lambda, logK, mExpect);
-        }
-      });
-    }
-    t.join_all();
+        this->FinishHit(*mHits[next]);
+      }
+    });
   }
 
   mHits.erase(
@@ -1463,10 +1572,58 @@ void BlastQuery<WORDSIZE>::WriteAsFasta(std::ostream& inStream)
   }
 }
 
+// The sequences are moved out of the hits, the query cannot be reported on
+// afterwards.
+template<int WORDSIZE>
+void BlastQuery<WORDSIZE>::GetHits(std::vector<BlastHit>& outHits)
+{
+  outHits.reserve(outHits.size() + mHits.size());
+
+  foreach (HitPtr hit, mHits)
+  {
+    outHits.push_back(BlastHit());
+    BlastHit& h = outHits.back();
+
+    std::string::size_type s = hit->mDefLine.find(' ');
+    if (s != std::string::npos)
+    {
+      h.id = hit->mDefLine.substr(1, s - 1);
+      h.def = hit->mDefLine.substr(s + 1);
+    }
+    else
+      h.id = hit->mDefLine.substr(1);
+
+    const Hsp& hsp = hit->mHsps.front();
+    h.query_start = hsp.mQueryStart;
+    h.query_end = hsp.mQueryEnd;
+    h.target_start = hsp.mTargetStart;
+    h.target_end = hsp.mTargetEnd;
+    h.length = static_cast<uint32>(hsp.mAlignedQuery.length());
+
+    // count identities against the query before it was filtered
+    h.identities = 0;
+    uint32 q = hsp.mQueryStart;
+    for (uint32 i = 0; i < h.length; ++i)
+    {
+      uint8 rq = hsp.mAlignedQuery[i], rt = hsp.mAlignedTarget[i];
+      if (rq == '-')
+        continue;
+      if (rt != '-' and ResidueNr(mUnfiltered[q]) == rt)
+        ++h.identities;
+      ++q;
+    }
+
+    h.seq.swap(hit->mTarget);
+  }
+
+  mHits.clear();
+}
+
 template<int WORDSIZE>
 void BlastQuery<WORDSIZE>::SearchPart(const char* inFasta, size_t inLength,
                                       MProgress& inProgress,
-  uint32& outDbCount, int64& outDbLength, std::vector<HitPtr>& outHits) const
+  uint32& outDbCount, int64& outDbLength, uint64& outHitCount,
+  std::vector<HitPtr>& outHits) const
 {
   const char* end = inFasta + inLength;
   int32 queryLength = static_cast<int32>(mQuery.length());
@@ -1483,7 +1640,7 @@ void BlastQuery<WORDSIZE>::SearchPart(const char* inFasta, size_t inLength,
   {
     if (hit)
     {
-      AddHit(hit, outHits);
+      AddHit(hit, outHits, outHitCount);
       hit.reset();
     }
 
@@ -1560,7 +1717,7 @@ void BlastQuery<WORDSIZE>::SearchPart(const char* inFasta, size_t inLength,
   }
 
   if (hit)
-    AddHit(hit, outHits);
+    AddHit(hit, outHits, outHitCount);
 }
 
 template<int WORDSIZE>
@@ -1919,12 +2076,60 @@ int32 BlastQuery<WORDSIZE>::AlignGappedSecond(const sequence& inTarget,
   return score;
 }
 
+template<int WORDSIZE>
+int64 BlastQuery<WORDSIZE>::SearchSpace(uint32 inDbCount,
+                                        int64 inDbLength) const
+{
+  int32 lengthAdjustment = ncbi::BlastComputeLengthAdjustment(
+      mMatrix, static_cast<uint32>(mQuery.length()), inDbLength, inDbCount);
+
+  int64 effectiveQueryLength = mQuery.length() - lengthAdjustment;
+  int64 effectiveDbLength = inDbLength - inDbCount * lengthAdjustment;
+
+  return effectiveDbLength * effectiveQueryLength;
+}
+
+// The second gapped alignment and the expect value cut off. Leaves no HSPs
+// if the hit is not to be reported.
+template<int WORDSIZE>
+void BlastQuery<WORDSIZE>::FinishHit(Hit& ioHit) const
+{
+  foreach (Hsp& hsp, ioHit.mHsps)
+    hsp.mScore = AlignGappedSecond(ioHit.mTarget, hsp);
+
+  ioHit.Cleanup(mSearchSpace, mMatrix.GappedLambda(),
+                log(mMatrix.GappedKappa()), mExpect);
+}
+
 template<int WORDSIZE>
 void BlastQuery<WORDSIZE>::AddHit(HitPtr inHit,
-                                  std::vector<HitPtr>& inHitList) const
+                                  std::vector<HitPtr>& inHitList,
+                                  uint64& ioHitCount) const
 {
   std::sort(inHit->mHsps.begin(), inHit->mHsps.end(), std::greater<Hsp>());
 
+  if (mSampleSize > 0)
+  {
+    // the search space is known up front when sampling, so only the hits
+    // that will be reported are counted and take part in the sample
+    FinishHit(*inHit);
+    if (inHit->mHsps.empty())
+      return;
+
+    ++ioHitCount;
+    inHitList.push_back(inHit);
+    inHit->mSampleKey = SampleKey(inHit->mDefLine, mSeed);
+
+    push_heap(inHitList.begin(), inHitList.end(), SampleOrder);
+    if (inHitList.size() > mSampleSize)
+    {
+      pop_heap(inHitList.begin(), inHitList.end(), SampleOrder);
+      inHitList.erase(inHitList.end() - 1);
+    }
+    return;
+  }
+
+  ++ioHitCount;
   inHitList.push_back(inHit);
 
   auto cmp = [](const HitPtr a, const HitPtr b) -> bool {
@@ -1939,13 +2144,43 @@ void BlastQuery<WORDSIZE>::AddHit(HitPtr inHit,
   }
 }
 
+// Keep the mSampleSize hits with the lowest keys, as a heap so that AddHit
+// can continue with it.
+template<int WORDSIZE>
+void BlastQuery<WORDSIZE>::TrimSample()
+{
+  if (mHits.size() > mSampleSize)
+  {
+    std::nth_element(mHits.begin(), mHits.begin() + mSampleSize, mHits.end(),
+                     SampleOrder);
+    mHits.erase(mHits.begin() + mSampleSize, mHits.end());
+  }
 
-void SearchAndWriteResultsAsFastA(
-    std::ostream& inOutFile, const std::vector<fs::path>& inDatabanks,
+  std::make_heap(mHits.begin(), mHits.end(), SampleOrder);
+}
+
+template<int WORDSIZE>
+void WriteResults(BlastQuery<WORDSIZE>& inQuery, std::ostream& inOutFile)
+{
+  inQuery.WriteAsFasta(inOutFile);
+}
+
+template<int WORDSIZE>
+void WriteResults(BlastQuery<WORDSIZE>& inQuery,
+                  std::vector<BlastHit>& outHits)
+{
+  inQuery.GetHits(outHits);
+}
+
+// returns whether the hits were sampled
+template<class Output>
+bool SearchAndWriteResults(
+    Output& inOutput, const std::vector<fs::path>& inDatabanks,
     const std::string& inQuery, const std::string& inProgram,
     const std::string& inMatrix, uint32 inWordSize, double inExpect,
     bool inFilter, bool inGapped, int32 inGapOpen, int32 inGapExtend,
-    uint32 inReportLimit, uint32 inThreads)
+    uint32 inReportLimit, uint32 inSampleSize, uint32 inSeed,
+    MScheduler& inScheduler)
 {
   if (inProgram != "blastp")
     throw mas_exception(boost::format("Unsupported program %s") % inProgram);
@@ -1995,29 +2230,55 @@ void SearchAndWriteResultsAsFastA(
     case 2:
     {
       BlastQuery<2> q(query, inFilter, inExpect, inMatrix, inGapped, inGapOpen,
-                      inGapExtend, inReportLimit);
-      q.Search(inDatabanks, progress, inThreads);
-      q.WriteAsFasta(inOutFile);
-      break;
+                      inGapExtend, inReportLimit, inSampleSize, inSeed);
+      q.Search(inDatabanks, progress, inScheduler);
+      WriteResults(q, inOutput);
+      return q.Sampled();
     }
     case 3:
     {
       BlastQuery<3> q(query, inFilter, inExpect, inMatrix, inGapped, inGapOpen,
-                      inGapExtend, inReportLimit);
-      q.Search(inDatabanks, progress, inThreads);
-      q.WriteAsFasta(inOutFile);
-      break;
+                      inGapExtend, inReportLimit, inSampleSize, inSeed);
+      q.Search(inDatabanks, progress, inScheduler);
+      WriteResults(q, inOutput);
+      return q.Sampled();
     }
     case 4:
     {
       BlastQuery<4> q(query, inFilter, inExpect, inMatrix, inGapped, inGapOpen,
-                      inGapExtend, inReportLimit);
-      q.Search(inDatabanks, progress, inThreads);
-      q.WriteAsFasta(inOutFile);
-      break;
+                      inGapExtend, inReportLimit, inSampleSize, inSeed);
+      q.Search(inDatabanks, progress, inScheduler);
+      WriteResults(q, inOutput);
+      return q.Sampled();
     }
     default:
       throw mas_exception(
           boost::format("Unsupported word size %d") % inWordSize);
   }
 }
+
+void SearchAndWriteResultsAsFastA(
+    std::ostream& inOutFile, const std::vector<fs::path>& inDatabanks,
+    const std::string& inQuery, const std::string& inProgram,
+    const std::string& inMatrix, uint32 inWordSize, double inExpect,
+    bool inFilter, bool inGapped, int32 inGapOpen, int32 inGapExtend,
+    uint32 inReportLimit, uint32 inThreads)
+{
+  MScheduler scheduler(inThreads);
+  SearchAndWriteResults(inOutFile, inDatabanks, inQuery, inProgram, inMatrix,
+    inWordSize, inExpect, inFilter, inGapped, inGapOpen, inGapExtend,
+    inReportLimit, 0, 0, scheduler);
+}
+
+bool SearchForHits(
+    std::vector<BlastHit>& outHits, const std::vector<fs::path>& inDatabanks,
+    const std::string& inQuery, const std::string& inProgram,
+    const std::string& inMatrix, uint32 inWordSize, double inExpect,
+    bool inFilter, bool inGapped, int32 inGapOpen, int32 inGapExtend,
+    uint32 inReportLimit, uint32 inSampleSize, uint32 inSeed,
+    MScheduler& inScheduler)
+{
+  return SearchAndWriteResults(outHits, inDatabanks, inQuery, inProgram,
+    inMatrix, inWordSize, inExpect, inFilter, inGapped, inGapOpen, inGapExtend,
+    inReportLimit, inSampleSize, inSeed, inScheduler);
+}
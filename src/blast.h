@@ -18,19 +18,33 @@
 
 #include <vector>
 
-//struct BlastHit
-//{
-//  std::string  id;
-//  std::string  acc;
-//  std::string  def;
-//  float    score;
-//  sequence  seq;
-//};
-//
-//// blast with default parameters
-//void Blast(const std::string& seq,
-//  const std::vector<boost::filesystem::path>& db,
-//  uint32 inReportLimit, std::vector<BlastHit>& outHits);
+class MScheduler;
+
+// A hit as reported by the search. The FastA header line is split at the
+// first space into the id and the definition, the sequence is encoded.
+// The coordinates (zero based, end exclusive) and number of identical
+// residues are those of the best scoring HSP.
+struct BlastHit
+{
+  std::string  id;
+  std::string  def;
+  sequence  seq;
+  uint32    query_start, query_end;
+  uint32    target_start, target_end;
+  uint32    identities, length;
+};
+
+// blast and return the hits, best first. With a sample size, no more than
+// that number of hits is kept while searching. These are a random selection
+// of the hits that pass the expect value cut off, which only depends on
+// inSeed. Returns true if hits were left out.
+bool SearchForHits(std::vector<BlastHit>& outHits,
+  const std::vector<boost::filesystem::path>& inDatabanks,
+  const std::string& inQuery, const std::string& inProgram,
+  const std::string& inMatrix, uint32 inWordSize, double inExpect,
+  bool inFilter, bool inGapped, int32 inGapOpen, int32 inGapExtend,
+  uint32 inReportLimit, uint32 inSampleSize, uint32 inSeed,
+  MScheduler& inScheduler);
 
 void SearchAndWriteResultsAsFastA(std::ostream& inOutFile,
   const std::vector<boost::filesystem::path>& inDatabanks,
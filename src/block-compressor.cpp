@@ -0,0 +1,351 @@
+// Copyright Maarten L. Hekkelman, Radboud University 2008-2011.
+// Copyright Coos Baakman, Jon Black, Wouter G. Touw & Gert Vriend, Radboud university medical center 2015.
+//   Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE_1_0.txt or copy at
+//             http://www.boost.org/LICENSE_1_0.txt)
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "block-compressor.h"
+
+#include "scheduler.h"
+#include "utils.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/mutex.hpp>
+
+#ifdef HAVE_LIBBZ2
+#include <bzlib.h>
+#endif
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#include <deque>
+#include <exception>
+#include <memory>
+#include <ostream>
+
+namespace ba = boost::algorithm;
+
+#define foreach BOOST_FOREACH
+
+// --------------------------------------------------------------------
+
+MCompression CompressionForFile(const std::string& inFile)
+{
+  MCompression result = eCompressNone;
+#ifdef HAVE_LIBBZ2
+  if (ba::ends_with(inFile, ".bz2"))
+    result = eCompressBZip2;
+#endif
+#ifdef HAVE_LIBZ
+  if (ba::ends_with(inFile, ".gz"))
+    result = eCompressGZip;
+#endif
+  return result;
+}
+
+// --------------------------------------------------------------------
+// The gzip blocks follow the BGZF layout used by samtools and tabix: every
+// member carries a 'BC' extra field holding its total size, which must fit
+// in 64k. Other gzip readers simply skip the extra field.
+
+namespace
+{
+
+const size_t
+  kBGZFBlockSize = 0xff00,
+  kBGZFMaxCompressedSize = 0x10000,
+  kBGZFHeaderSize = 18,
+  kBGZFFooterSize = 8,
+  // about one bzip2 block at the default block size of 900k. That limit
+  // applies after bzip2's first run length encoding, which expands runs of
+  // four equal bytes, so a stream may end with a second, small block.
+  kBZip2BlockSize = 900000 - 1000;
+
+const uint8 kBGZFEOF[28] = {
+  0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+  0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00
+};
+
+struct MBlock
+{
+  std::string m_data, m_compressed;
+  bool m_done;
+  std::exception_ptr m_error;
+
+  MBlock() : m_done(false) {}
+};
+
+#ifdef HAVE_LIBZ
+void PutLE(std::string& s, size_t inOffset, uint32 inValue, uint32 inBytes)
+{
+  for (uint32 i = 0; i < inBytes; ++i, inValue >>= 8)
+    s[inOffset + i] = char(inValue & 0xff);
+}
+
+void CompressGZip(MBlock& ioBlock, int inLevel)
+{
+  const std::string& data = ioBlock.m_data;
+  std::string& out = ioBlock.m_compressed;
+
+  z_stream z = {};
+  if (deflateInit2(&z, inLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    throw mas_exception("Could not initialise zlib");
+
+  out.assign(kBGZFHeaderSize + deflateBound(&z, data.length()) + kBGZFFooterSize, 0);
+
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  z.avail_in = data.length();
+  z.next_out = reinterpret_cast<Bytef*>(&out[kBGZFHeaderSize]);
+  z.avail_out = out.length() - kBGZFHeaderSize - kBGZFFooterSize;
+
+  int err = deflate(&z, Z_FINISH);
+  size_t size = kBGZFHeaderSize + z.total_out + kBGZFFooterSize;
+  deflateEnd(&z);
+
+  if (err != Z_STREAM_END)
+    throw mas_exception("Error compressing gzip block");
+
+  // incompressible data, store it instead
+  if (size > kBGZFMaxCompressedSize)
+  {
+    CompressGZip(ioBlock, Z_NO_COMPRESSION);
+    return;
+  }
+
+  out.resize(size);
+
+  const char header[kBGZFHeaderSize - 2] = {
+    '\x1f', '\x8b', 8, 4, 0, 0, 0, 0, 0, '\xff', 6, 0, 'B', 'C', 2, 0
+  };
+  out.replace(0, sizeof(header), header, sizeof(header));
+  PutLE(out, 16, size - 1, 2);
+
+  uint32 crc = crc32(0, reinterpret_cast<const Bytef*>(data.data()), data.length());
+  PutLE(out, size - 8, crc, 4);
+  PutLE(out, size - 4, data.length(), 4);
+}
+#endif
+
+#ifdef HAVE_LIBBZ2
+void CompressBZip2(MBlock& ioBlock)
+{
+  const std::string& data = ioBlock.m_data;
+  std::string& out = ioBlock.m_compressed;
+
+  // the worst case expansion as documented for BZ2_bzBuffToBuffCompress
+  out.assign(data.length() + data.length() / 100 + 600, 0);
+
+  unsigned int size = out.length();
+  int err = BZ2_bzBuffToBuffCompress(&out[0], &size,
+    const_cast<char*>(data.data()), data.length(), 9, 0, 30);
+  if (err != BZ_OK)
+    throw mas_exception(boost::format("Error compressing bzip2 block (%d)") % err);
+
+  out.resize(size);
+}
+#endif
+
+void Compress(MCompression inCompression, MBlock& ioBlock)
+{
+  switch (inCompression)
+  {
+#ifdef HAVE_LIBZ
+    case eCompressGZip:  CompressGZip(ioBlock, Z_DEFAULT_COMPRESSION); break;
+#endif
+#ifdef HAVE_LIBBZ2
+    case eCompressBZip2: CompressBZip2(ioBlock); break;
+#endif
+    default:             ioBlock.m_compressed = ioBlock.m_data; break;
+  }
+}
+
+}
+
+// --------------------------------------------------------------------
+
+struct MBlockCompressor::MBlockCompressorImpl
+{
+                MBlockCompressorImpl(std::ostream& inSink,
+                                     MCompression inCompression,
+                                     MScheduler& inScheduler);
+                ~MBlockCompressorImpl();
+
+  void          Write(const char* inData, size_t inSize);
+  void          Close();
+
+  // post the current block to the scheduler
+  void          Submit();
+  // write the finished blocks at the front of the queue, waiting for them
+  // as long as more than inMaxPending blocks are outstanding
+  void          Flush(size_t inMaxPending);
+  // wait until no posted block is being compressed anymore
+  void          Stop();
+  void          Run(MBlock* inBlock);
+
+  std::ostream& m_sink;
+  MCompression  m_compression;
+  size_t        m_block_size;
+  MScheduler&   m_scheduler;
+  uint64        m_blocks_written;
+  bool          m_closed;
+
+  MBlock*       m_current;
+  std::deque<MBlock*>
+                m_pending;
+  boost::mutex  m_mutex;
+  boost::condition
+                m_block_done;
+};
+
+MBlockCompressor::MBlockCompressorImpl::MBlockCompressorImpl(
+  std::ostream& inSink, MCompression inCompression, MScheduler& inScheduler)
+  : m_sink(inSink), m_compression(inCompression)
+  , m_block_size(MBlockCompressor::BlockSize(inCompression))
+  , m_scheduler(inScheduler), m_blocks_written(0), m_closed(false)
+  , m_current(new MBlock)
+{
+  m_current->m_data.reserve(m_block_size);
+}
+
+MBlockCompressor::MBlockCompressorImpl::~MBlockCompressorImpl()
+{
+  Stop();
+
+  delete m_current;
+  foreach (MBlock* block, m_pending)
+    delete block;
+}
+
+void MBlockCompressor::MBlockCompressorImpl::Run(MBlock* inBlock)
+{
+  try
+  {
+    Compress(m_compression, *inBlock);
+  }
+  catch (...)
+  {
+    inBlock->m_error = std::current_exception();
+  }
+
+  boost::mutex::scoped_lock lock(m_mutex);
+  inBlock->m_done = true;
+  m_block_done.notify_all();
+}
+
+void MBlockCompressor::MBlockCompressorImpl::Stop()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  foreach (MBlock* block, m_pending)
+  {
+    while (not block->m_done)
+      m_block_done.wait(lock);
+  }
+}
+
+void MBlockCompressor::MBlockCompressorImpl::Write(const char* inData, size_t inSize)
+{
+  while (inSize > 0)
+  {
+    size_t n = m_block_size - m_current->m_data.length();
+    if (n > inSize)
+      n = inSize;
+
+    m_current->m_data.append(inData, n);
+    inData += n;
+    inSize -= n;
+
+    if (m_current->m_data.length() == m_block_size)
+      Submit();
+  }
+}
+
+void MBlockCompressor::MBlockCompressorImpl::Submit()
+{
+  MBlock* block = m_current;
+  m_current = new MBlock;
+  m_current->m_data.reserve(m_block_size);
+
+  m_pending.push_back(block);
+
+  // with a single thread Post compresses the block right away
+  m_scheduler.Post([this, block]() { Run(block); });
+  Flush(m_scheduler.Size() > 1 ? 2 * m_scheduler.Size() : 0);
+}
+
+void MBlockCompressor::MBlockCompressorImpl::Flush(size_t inMaxPending)
+{
+  while (not m_pending.empty())
+  {
+    MBlock* block = m_pending.front();
+
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      while (not block->m_done and m_pending.size() > inMaxPending)
+        m_block_done.wait(lock);
+      if (not block->m_done)
+        break;
+    }
+
+    m_pending.pop_front();
+    std::unique_ptr<MBlock> done(block);
+
+    if (done->m_error)
+      std::rethrow_exception(done->m_error);
+
+    m_sink.write(done->m_compressed.data(), done->m_compressed.length());
+    ++m_blocks_written;
+  }
+}
+
+void MBlockCompressor::MBlockCompressorImpl::Close()
+{
+  if (m_closed)
+    return;
+  m_closed = true;
+
+  // an empty bzip2 file still needs one (empty) stream
+  if (not m_current->m_data.empty() or
+      (m_blocks_written == 0 and m_pending.empty() and m_compression == eCompressBZip2))
+    Submit();
+
+  Flush(0);
+  Stop();
+
+  if (m_compression == eCompressGZip)
+    m_sink.write(reinterpret_cast<const char*>(kBGZFEOF), sizeof(kBGZFEOF));
+
+  m_sink.flush();
+}
+
+// --------------------------------------------------------------------
+
+MBlockCompressor::MBlockCompressor(std::ostream& inSink,
+                                   MCompression inCompression,
+                                   MScheduler& inScheduler)
+  : m_impl(new MBlockCompressorImpl(inSink, inCompression, inScheduler))
+{
+}
+
+std::streamsize MBlockCompressor::write(const char* inData, std::streamsize inSize)
+{
+  m_impl->Write(inData, inSize);
+  return inSize;
+}
+
+void MBlockCompressor::close()
+{
+  m_impl->Close();
+}
+
+size_t MBlockCompressor::BlockSize(MCompression inCompression)
+{
+  return inCompression == eCompressBZip2 ? kBZip2BlockSize : kBGZFBlockSize;
+}
@@ -0,0 +1,56 @@
+// Copyright Maarten L. Hekkelman, Radboud University 2008-2011.
+// Copyright Coos Baakman, Jon Black, Wouter G. Touw & Gert Vriend, Radboud university medical center 2015.
+//   Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE_1_0.txt or copy at
+//             http://www.boost.org/LICENSE_1_0.txt)
+//
+// MBlockCompressor is a boost::iostreams sink that cuts its output into
+// independent blocks and compresses these as tasks on an MScheduler. The blocks are
+// written in order as complete gzip members (BGZF layout) or bzip2 streams,
+// so the result is a regular multi-member file that gunzip, bunzip2 and the
+// boost decompressors read back as one stream.
+
+#pragma once
+
+#include "mas.h"
+
+#include <boost/iostreams/categories.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <iosfwd>
+#include <string>
+
+class MScheduler;
+
+enum MCompression
+{
+  eCompressNone,
+  eCompressGZip,
+  eCompressBZip2
+};
+
+// compression implied by the extension of inFile, eCompressNone when that
+// compression was not compiled in
+MCompression CompressionForFile(const std::string& inFile);
+
+class MBlockCompressor
+{
+  public:
+  typedef char char_type;
+  struct category : boost::iostreams::sink_tag, boost::iostreams::closable_tag {};
+
+                // inScheduler must outlive the compressor
+                MBlockCompressor(std::ostream& inSink, MCompression inCompression,
+                                 MScheduler& inScheduler);
+
+  std::streamsize
+                write(const char* inData, std::streamsize inSize);
+  void          close();
+
+  // uncompressed size of one block
+  static size_t BlockSize(MCompression inCompression);
+
+  private:
+  struct MBlockCompressorImpl;
+  boost::shared_ptr<MBlockCompressorImpl> m_impl;
+};
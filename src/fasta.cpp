@@ -39,19 +39,7 @@ std::vector<MProtein*> read_proteins_from_fasta(std::istream& in)
     }
 
     // Create the Protein instance
-    MChain* chain = new MChain("A");
-    std::vector<MResidue*>& residues = chain->GetResidues();
-    MResidue* last = nullptr;
-    int32 nr = 1;
-    for (auto& r: seq)
-    {
-      residues.push_back(new MResidue(nr, r, last));
-      ++nr;
-      last = residues.back();
-    }
-
-    MProtein* result = new MProtein(id, chain);
-    proteins.push_back(result);
+    proteins.push_back(new MProtein(id, seq));
   }
 
   return proteins;
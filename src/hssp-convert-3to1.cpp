@@ -9,6 +9,7 @@
 #endif
 
 #include "buffer.h"
+#include "line-buffer.h"
 #include "mas.h"
 #include "utils.h"
 
@@ -891,8 +892,8 @@ void CreateHSSPOutput(const std::string& inProteinID,
      << "  NR.    ID         STRID   %IDE %WSIM IFIR ILAS JFIR JLAS LALI NGAP LGAP LSEQ2 ACCNUM     PROTEIN" << std::endl;
 
   // print the first list
+  MLineBuffer line;
   uint32 nr = 1;
-  boost::format fmt1("%5.5d : %12.12s%4.4s    %4.2f  %4.2f%5.5d%5.5d%5.5d%5.5d%5.5d%5.5d%5.5d%5.5d  %10.10s %s");
   foreach (hit_ptr h, hits)
   {
     const seq& s(msa[h->m_seq]);
@@ -913,14 +914,13 @@ void CreateHSSPOutput(const std::string& inProteinID,
     if (pdb.empty())
       pdb.append(4, ' ');
 
-    os << fmt1 % nr
-           % id % pdb
-           % s.identity() % s.similarity()
-           % (s.ifir() + h->m_offset) % (s.ilas() + h->m_offset)
-           % s.jfir() % s.jlas() % s.alignment_length()
-           % s.gaps() % s.gapn() % s.seqlen()
-           % acc % s.desc()
-       << std::endl;
+    line.Right(nr, 5).Append(" : ").Right(id, 12).Right(pdb, 4)
+        .Append("    ").Fixed(s.identity(), 4, 2).Append("  ").Fixed(s.similarity(), 4, 2)
+        .Right(s.ifir() + h->m_offset, 5).Right(s.ilas() + h->m_offset, 5)
+        .Right(s.jfir(), 5).Right(s.jlas(), 5).Right(s.alignment_length(), 5)
+        .Right(s.gaps(), 5).Right(s.gapn(), 5).Right(s.seqlen(), 5)
+        .Append("  ").Right(acc, 10).Append(' ').Append(s.desc());
+    line.Write(os);
 
     ++nr;
   }
@@ -929,8 +929,7 @@ void CreateHSSPOutput(const std::string& inProteinID,
   for (uint32 i = 0; i < hits.size(); i += 70)
   {
     uint32 m = i + 70,
-           n = m,
-           j;
+           n = m;
     if (n > hits.size())
       n = hits.size();
 
@@ -953,7 +952,9 @@ void CreateHSSPOutput(const std::string& inProteinID,
 
     foreach (res_ptr ri, res)
     {
-      std::string aln;
+      line.Append(' ').Right(nr, 5)
+          .Append(ri->m_ri.c_str(), std::min<size_t>(ri->m_ri.length(), 43))
+          .Append("  ");
 
       if (ri->m_ri[6] != '!')
       {
@@ -965,17 +966,17 @@ void CreateHSSPOutput(const std::string& inProteinID,
           uint32 ilas = s.ilas() + hit->m_offset;
 
           if (nr >= ifir and nr <= ilas)
-            aln += msa[hit->m_seq][ri->m_pos];
+            line.Append(msa[hit->m_seq][ri->m_pos]);
           else
-            aln += ' ';
+            line.Append(' ');
         }
 
         // Add whitespace placeholders.
-        for (j = n; j < m; j++)
-          aln += ' ';
+        line.Append(' ', m - n);
       }
 
-      os << boost::format(" %5.5d") % nr << ri->m_ri.substr(0, 43) << "  " << aln << ri->m_ri.substr(43) << std::endl;
+      line.Append(ri->m_ri.substr(43));
+      line.Write(os);
       ++nr;
     }
   }
@@ -988,10 +989,12 @@ void CreateHSSPOutput(const std::string& inProteinID,
   nr = 1;
   foreach (res_ptr r, res)
   {
+    line.Right(nr, 5);
     if (r->m_pr.empty())
-      os << boost::format("%5.5d") % nr << "          0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0     0    0    0   0.000      0  1.00" << std::endl;
+      line.Append("          0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0     0    0    0   0.000      0  1.00");
     else
-      os << boost::format("%5.5d") % nr << r->m_pr << std::endl;
+      line.Append(r->m_pr);
+    line.Write(os);
     ++nr;
   }
 
@@ -1,12 +1,13 @@
 #include "hssp-nt.h"
 
 #include "blast.h"
-#include "buffer.h"
 #ifdef HAVE_LIBZEEP
   #include "fetchdbrefs.h"
 #endif
+#include "line-buffer.h"
 #include "matrix.h"
 #include "progress.h"
+#include "scheduler.h"
 #include "structure.h"
 #include "utils.h"
 
@@ -18,23 +19,25 @@
 #include <boost/filesystem/operations.hpp>
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
-#include <boost/iostreams/copy.hpp>
-#include <boost/iostreams/device/back_inserter.hpp>
-#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/range/adaptor/sliced.hpp>
 #include <boost/regex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <algorithm>
 #include <cmath>
+#include <exception>
 #include <iostream>
 #include <set>
+#include <sstream>
+#include <unordered_map>
 
 #define foreach BOOST_FOREACH
 
 namespace fs = boost::filesystem;
 namespace ba = boost::algorithm;
-namespace io = boost::iostreams;
 
 namespace HSSP
 {
@@ -152,6 +155,103 @@ float calculateDistance(const sequence& a, const sequence& b)
   return result;
 }
 
+// The same calculation, restricted to the band of diagonals (x - y) from
+// inDiagonalLo to inDiagonalHi, e.g. around the HSP found by BLAST. Row x
+// of the matrices holds the cells with y from x - inDiagonalHi on, so the
+// cells above, to the left and diagonally before are at k + 1, k - 1 and k
+// in the previous or current row.
+float calculateDistance(const sequence& a, const sequence& b,
+                        int32 inDiagonalLo, int32 inDiagonalHi)
+{
+  const float kDistanceGapOpen = 10;
+  const float kDistanceGapExtend = 0.2f;
+  const float kUnreachable = -std::numeric_limits<float>::max();
+
+  int32 dimX = static_cast<int32>(a.length());
+  int32 dimY = static_cast<int32>(b.length());
+
+  int32 lo = std::max(inDiagonalLo, -(dimY - 1));
+  int32 hi = std::min(inDiagonalHi, dimX - 1);
+  if (lo > hi)
+    return calculateDistance(a, b);
+
+  int32 width = hi - lo + 1;
+
+  matrix<float>  B(dimX, width);
+  matrix<float>  Ix(dimX, width);
+  matrix<float>  Iy(dimX, width);
+  matrix<uint16>  id(dimX, width);
+
+  float high = kUnreachable;
+  uint16 highId = 0;
+  bool reached = false;
+
+  for (int32 x = 0; x < dimX; ++x)
+  {
+    int32 y0 = std::max(0, x - hi), y1 = std::min(dimY - 1, x - lo);
+    for (int32 y = y0; y <= y1; ++y)
+    {
+      int32 k = y - x + hi;
+
+      float Ix1 = 0;
+      if (x > 0) Ix1 = k + 1 < width ? Ix(x - 1, k + 1) : kUnreachable;
+      float Iy1 = 0;
+      if (y > 0) Iy1 = k > 0 ? Iy(x, k - 1) : kUnreachable;
+
+      float M = score(kMPam250, a[x], b[y]);
+      if (x > 0 and y > 0)
+        M += B(x - 1, k);
+
+      float s;
+      uint32 i = 0;
+      if (a[x] == b[y])
+        i = 1;
+
+      if (M >= Ix1 and M >= Iy1)
+      {
+        if (x > 0 and y > 0)
+          i += id(x - 1, k);
+        s = M;
+      }
+      else if (Ix1 >= Iy1)
+      {
+        if (x > 0)
+          i += id(x - 1, k + 1);
+        s = Ix1;
+      }
+      else
+      {
+        if (y > 0)
+          i += id(x, k - 1);
+        s = Iy1;
+      }
+
+      B(x, k) = s;
+      id(x, k) = i;
+
+      if ((x == dimX - 1 or y == dimY - 1) and high < s)
+      {
+        high = s;
+        highId = i;
+        reached = true;
+      }
+
+      Ix(x, k) = std::max(M - kDistanceGapOpen, Ix1 - kDistanceGapExtend);
+      Iy(x, k) = std::max(M - kDistanceGapOpen, Iy1 - kDistanceGapExtend);
+    }
+  }
+
+  if (not reached)
+    return calculateDistance(a, b);
+
+  float result = 1.0f - float(highId) / std::max(dimX, dimY);
+
+  assert(result >= 0.0f);
+  assert(result <= 1.0f);
+
+  return result;
+}
+
 // ----------------------------------------------------
 
 char GetAACode(char oneLetterCode, int64 bridgeNumberSS)
@@ -313,7 +413,10 @@ struct MHit
       m_ifir(0),
       m_ilas(0),
       m_jfir(0),
-      m_jlas(0)
+      m_jlas(0),
+      m_column_mark(0),
+      m_diagonal_lo(0),
+      m_diagonal_hi(0)
   {
   }
 
@@ -324,18 +427,23 @@ struct MHit
     std::string m_seq;
   };
 
-  static MHitPtr Create(const std::string& id, const std::string& def,
-                        const std::string& seq);
+  static MHitPtr Create(BlastHit& inHit);
 
-  void CalculateDistance(const sequence& chain);
+  void CalculateDistance(const sequence& chain, uint32 inBand);
 
   std::string m_id, m_acc, m_def, m_stid;
   sequence m_seq;
+  // While the profile is being built, m_aligned only covers the columns
+  // that existed when this hit was accepted, i.e. those with an id below
+  // m_column_mark. MProfile::ExpandAlignments fills in the later columns.
   std::string m_aligned;
   float m_distance, m_score;
   int32 m_ifir, m_ilas, m_jfir, m_jlas;
   uint32 m_identical, m_similar, m_length;
   uint32 m_gaps, m_gapn;
+  uint32 m_column_mark;
+  // diagonals (hit position - chain position) of the BLAST HSP
+  int32 m_diagonal_lo, m_diagonal_hi;
   std::vector<insertion> m_insertions;
 };
 
@@ -354,10 +462,11 @@ std::ostream& operator<<(std::ostream& os, const MHit& hit)
   return os;
 }
 
-MHitPtr MHit::Create(const std::string& id, const std::string& def,
-                     const std::string& seq)
+// Takes over the sequence of the blast hit
+MHitPtr MHit::Create(BlastHit& inHit)
 {
-  MHitPtr result(new MHit(id, def, encode(seq)));
+  MHitPtr result(new MHit(inHit.id, inHit.def, sequence()));
+  result->m_seq.swap(inHit.seq);
 
   static const boost::regex
     kM6FastARE("^(\\w+)((?:\\|([^| ]*))(?:\\|([^| ]+))?(?:\\|([^| ]+))?(?:\\|([^| ]+))?)");
@@ -379,29 +488,86 @@ MHitPtr MHit::Create(const std::string& id, const std::string& def,
 
   result->m_distance = 0;
 
+  int32 start = static_cast<int32>(inHit.target_start - inHit.query_start);
+  int32 end = static_cast<int32>(inHit.target_end - inHit.query_end);
+  result->m_diagonal_lo = std::min(start, end);
+  result->m_diagonal_hi = std::max(start, end);
+
   return result;
 }
 
-void MHit::CalculateDistance(const sequence& chain)
+void MHit::CalculateDistance(const sequence& chain, uint32 inBand)
 {
-  m_distance = calculateDistance(m_seq, chain);
+  if (inBand > 0)
+    m_distance = calculateDistance(m_seq, chain, m_diagonal_lo - inBand,
+                                   m_diagonal_hi + inBand);
+  else
+    m_distance = calculateDistance(m_seq, chain);
 }
 
 // --------------------------------------------------------------------
 
+// The outcome of aligning a hit against the profile, the part of the trace
+// back that is to be added and the profile columns it was made against.
+struct MAlignment
+{
+  int32 m_high_x, m_high_y;
+  uint32 m_identical, m_similar, m_length, m_xgaps;
+  uint32 m_column_count;
+  std::vector<int8> m_trace;
+};
+
+// Chains are processed concurrently, but random_shuffle draws from the one
+// global rand() sequence. To select the same hits as when the chains are
+// processed one after the other, a chain may only shuffle once all chains
+// before it are done shuffling.
+class MRandomTurn
+{
+  public:
+    MRandomTurn(uint32 inChains) : m_done(inChains, false), m_first(0) {}
+
+    // wait until all chains before inChain are done
+    void Wait(uint32 inChain)
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      while (m_first < inChain)
+        m_condition.wait(lock);
+    }
+
+    void Done(uint32 inChain)
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      m_done[inChain] = true;
+      while (m_first < m_done.size() and m_done[m_first])
+        ++m_first;
+      m_condition.notify_all();
+    }
+
+  private:
+    boost::mutex m_mutex;
+    boost::condition m_condition;
+    std::vector<bool> m_done;
+    uint32 m_first;
+};
+
 struct MProfile
 {
   MProfile(const MChain& inChain, const sequence& inSequence,
            float inThreshold, float inFragmentCutOff);
   ~MProfile();
 
-  void Process(std::istream& inHits, float inGapOpen, float inGapExtend,
-               uint32 inMaxHits, uint32 inThreads);
+  void Process(std::vector<BlastHit>& inHits, float inGapOpen, float inGapExtend,
+               uint32 inMaxHits, MScheduler& inScheduler, uint32 inAlignWindow,
+               uint32 inAlignStaleness, uint32 inDistanceBand);
   void Align(MHitPtr e, float inGapOpen, float inGapExtend);
+  bool Align(MHitPtr e, float inGapOpen, float inGapExtend,
+             MAlignment& outAlignment) const;
+  void Commit(MHitPtr e, const MAlignment& inAlignment);
+  void ExpandAlignments();
 
-  void AdjustXGapCosts(std::vector<float>& gop, std::vector<float>& gep);
+  void AdjustXGapCosts(std::vector<float>& gop, std::vector<float>& gep) const;
   void AdjustYGapCosts(const sequence& s, std::vector<float>& gop,
-                       std::vector<float>& gep);
+                       std::vector<float>& gep) const;
   void dump(const matrix<float>& B, const matrix<float>& Ix,
             const matrix<float>& Iy, const matrix<int8>& tb,
             const std::vector<float>& gopX, const std::vector<float>& gopY,
@@ -415,16 +581,31 @@ struct MProfile
                       const std::vector<std::string>& inUsed,
                       const std::vector<std::string>& inAKA) const;
 
-  void CalculateConservation(uint32 inThreads);
+  void CalculateConservation(MScheduler& inScheduler);
+
+  template<class T>
+  void Shuffle(std::vector<T>& v)
+  {
+    if (m_turn != nullptr)
+      m_turn->Wait(m_turn_nr);
+    random_shuffle(v.begin(), v.end());
+    m_shuffled = true;
+  }
 
   const MChain&  m_chain;
   sequence m_seq;
   MResInfoList m_residues;
+  // Every column in the alignment gets a unique id, in order of creation.
+  // m_columns holds these ids in the current column order.
+  std::vector<uint32> m_columns;
+  uint32 m_column_count;
   std::vector<MHitPtr> m_entries;
   float m_threshold;
   float m_frag_cutoff;
   float m_sum_dist_weight;
   bool m_shuffled;
+  MRandomTurn* m_turn;
+  uint32 m_turn_nr;
 };
 
 MProfile::MProfile(const MChain& inChain, const sequence& inSequence,
@@ -434,7 +615,10 @@ MProfile::MProfile(const MChain& inChain, const sequence& inSequence,
     m_threshold(inThreshold),
     m_frag_cutoff(inFragmentCutOff),
     m_sum_dist_weight(0),
-    m_shuffled(false)
+    m_shuffled(false),
+    m_turn(nullptr),
+    m_turn_nr(0),
+    m_column_count(0)
 {
   const std::vector<MResidue*>& residues = m_chain.GetResidues();
   std::vector<MResidue*>::const_iterator ri = residues.begin();
@@ -464,6 +648,7 @@ MProfile::MProfile(const MChain& inChain, const sequence& inSequence,
     res.m_accessibility = (*ri)->Accessibility();
     res.Add(res.m_letter, 0);
     m_residues.push_back(res);
+    m_columns.push_back(m_column_count++);
 
     ++ri;
     ++seq_nr;
@@ -517,14 +702,14 @@ void MProfile::dump(const matrix<float>& B, const matrix<float>& Ix,
 }
 
 void MProfile::AdjustXGapCosts(std::vector<float>& gop,
-                               std::vector<float>& gep)
+                               std::vector<float>& gep) const
 {
   assert(gop.size() == m_seq.length());
   assert(gop.size() == m_residues.size());
 
   for (size_t ix = 0; ix < m_residues.size(); ++ix)
   {
-    MResInfo& e = m_residues[ix];
+    const MResInfo& e = m_residues[ix];
 
     // adjust for secondary structure
     switch (e.m_ss)
@@ -589,7 +774,7 @@ const float kResidueSpecificPenalty[22] = {
 };
 
 void MProfile::AdjustYGapCosts(const sequence& s, std::vector<float>& gop,
-                               std::vector<float>& gep)
+                               std::vector<float>& gep) const
 {
   for (uint32 y = 0; y < s.length(); ++y)
   {
@@ -598,7 +783,10 @@ void MProfile::AdjustYGapCosts(const sequence& s, std::vector<float>& gop,
   }
 }
 
-void MProfile::Align(MHitPtr e, float inGapOpen, float inGapExtend)
+// Aligning a hit against the profile does not change the profile, so it can
+// be done for several hits concurrently. Only accepted hits are committed.
+bool MProfile::Align(MHitPtr e, float inGapOpen, float inGapExtend,
+                     MAlignment& outAlignment) const
 {
   int32 x = 0, dimX = static_cast<int32>(m_seq.length());
   int32 y = 0, dimY = static_cast<int32>(e->m_seq.length());
@@ -678,17 +866,6 @@ void MProfile::Align(MHitPtr e, float inGapOpen, float inGapExtend)
     }
   }
 
-//#if not NDEBUG
-//
-//bool dmp = false;
-//if (e->m_acc == "Q0IJ18")
-//{
-//  dmp = true;
-//  dump(B, Ix, Iy, tb, gop_a, gop_b, gep_a, gep_b, m_seq, e->m_seq);
-//}
-//
-//#endif
-
   // build the alignment
   x = highX;
   y = highY;
@@ -745,135 +922,212 @@ void MProfile::Align(MHitPtr e, float inGapOpen, float inGapExtend)
   //
   // accept only alignment long enough (suppress fragments)
   // and those that score high enough
-  if (length >= m_seq.length() * m_frag_cutoff and
-    ident >= length * (kHomologyThreshold[tix] + m_threshold))
+  if (length < m_seq.length() * m_frag_cutoff or
+      ident < length * (kHomologyThreshold[tix] + m_threshold))
+    return false;
+
+  int32 fx = x + 1, fy = y + 1;
+
+  outAlignment.m_high_x = highX;
+  outAlignment.m_high_y = highY;
+  outAlignment.m_identical = ident;
+  outAlignment.m_similar = similar;
+  outAlignment.m_length = length;
+  outAlignment.m_xgaps = xgaps;
+  outAlignment.m_column_count = m_column_count;
+  outAlignment.m_trace.clear();
+
+  // record the part of the trace that will be added to the profile
+  x = highX;
+  y = highY;
+
+  lengthI = length;
+  while (x >= fx and y >= fy and lengthI-- > 0)
   {
-    // reserve space, if needed
-    if (xgaps > 0)
+    int8 t = tb(x, y);
+    outAlignment.m_trace.push_back(t);
+
+    switch (t)
     {
-      const uint32 kBlockSize = 1024;
-      uint32 n = static_cast<uint32>(
-          (((m_residues.size() + xgaps) / kBlockSize) + 1) * kBlockSize);
-      m_seq.reserve(n);
-      foreach (MHitPtr e, m_entries)
-        e->m_aligned.reserve(n);
+      case -1:  --y;  break;
+      case 1:   if (is_gap(m_seq[x])) ++lengthI; --x; break;
+      case 0:   --x; --y; break;
+    }
+  }
+
+  return true;
+}
+
+// Add an accepted hit to the profile. The alignment may have been made
+// against an older version of the profile, in which case the columns
+// inserted since are mapped out and count as gaps for this hit.
+void MProfile::Commit(MHitPtr e, const MAlignment& inAlignment)
+{
+  uint32 xgaps = inAlignment.m_xgaps;
+
+  // reserve space, if needed
+  if (xgaps > 0)
+  {
+    const uint32 kBlockSize = 1024;
+    uint32 n = static_cast<uint32>(
+        (((m_residues.size() + xgaps) / kBlockSize) + 1) * kBlockSize);
+    m_seq.reserve(n);
+    m_columns.reserve(n);
+  }
+
+  // positions of the columns the alignment knows about
+  bool stale = inAlignment.m_column_count != m_column_count;
+  std::vector<int32> column;
+  if (stale)
+  {
+    for (size_t i = 0; i < m_columns.size(); ++i)
+    {
+      if (m_columns[i] < inAlignment.m_column_count)
+        column.push_back(static_cast<int32>(i));
     }
+  }
+
+  auto pos = [stale, &column](int32 x) -> int32 {
+    return stale ? column[x] : x;
+  };
 
-    int32 fx = x + 1, fy = y + 1;
+  // update insert/delete counters for the residues
+  int32 x = inAlignment.m_high_x;  e->m_ilas = m_residues[pos(x)].m_seq_nr;
+  int32 y = inAlignment.m_high_y;  e->m_jlas = y + 1;
 
-    // update insert/delete counters for the residues
-    x = highX;  e->m_ilas = m_residues[x].m_seq_nr;
-    y = highY;  e->m_jlas = y + 1;
+  // trace back to fill aligned sequence and to create gaps in MSA
+  e->m_aligned = std::string(m_seq.length() + xgaps, '.');
+  bool gappedx = false, gappedy = false;
+
+  int32 last = -1;
+  foreach (int8 t, inAlignment.m_trace)
+  {
+    int32 px = pos(x);
 
-    // trace back to fill aligned sequence and to create gaps in MSA
-    e->m_aligned = std::string(m_seq.length() + xgaps, '.');
-    bool gappedx = false, gappedy = false;
+    // columns inserted after the alignment was made
+    for (int32 i = last - 1; i > px; --i)
+      m_residues[i].AddGap(e->m_distance);
+    last = px;
 
-    lengthI = length;
-    while (x >= fx and y >= fy and lengthI-- > 0)
+    switch (t)
     {
-      switch (tb(x, y))
-      {
-        case -1:
-          e->m_aligned[x + xgaps] = kResidues[e->m_seq[y]];
+      case -1:
+        e->m_aligned[px + xgaps] = kResidues[e->m_seq[y]];
 
-          m_residues.insert(m_residues.begin() + x + 1,
-            MResInfo::NewGap(m_entries.size() + 1,
-                             m_sum_dist_weight, e->m_seq[y], e->m_distance));
+        m_residues.insert(m_residues.begin() + px + 1,
+          MResInfo::NewGap(m_entries.size() + 1,
+                           m_sum_dist_weight, e->m_seq[y], e->m_distance));
 
-          m_seq.insert(m_seq.begin() + x + 1, '.');
+        m_seq.insert(m_seq.begin() + px + 1, '.');
 
-          foreach (MHitPtr e, m_entries)
-            e->m_aligned.insert(e->m_aligned.begin() + x + 1, '.');
+        // the entries accepted so far do not know this column yet, it
+        // is added to their m_aligned in ExpandAlignments
+        m_columns.insert(m_columns.begin() + px + 1, m_column_count++);
 
-          --y;
-          --xgaps;
+        --y;
+        --xgaps;
 
-          if (not gappedx)
+        if (not gappedx)
+          ++e->m_gaps;
+        ++e->m_gapn;
+        gappedx = true;
+        gappedy = false;
+        break;
+
+      case 1:
+        if (not is_gap(m_seq[px]))
+        {
+          if (not gappedy)
             ++e->m_gaps;
           ++e->m_gapn;
+          gappedx = false;
+          gappedy = true;
+        }
+
+        m_residues[px].AddGap(e->m_distance);
+        --x;
+        break;
+
+      case 0:
+        e->m_aligned[px + xgaps] = kResidues[e->m_seq[y]];
+        m_residues[px].Add(e->m_seq[y], e->m_distance);
+
+        if (not is_gap(e->m_seq[y]) and is_gap(m_seq[px]))
+        {
+          if (not gappedx)
+            ++e->m_gaps;
           gappedx = true;
+          ++e->m_gapn;
+        }
+        else if (gappedx)
+        {
+          ++m_residues[px].m_ins;
+          gappedx = false;
+        }
+
+        if (gappedy)
+        {
+          ++m_residues[px].m_del;
           gappedy = false;
-          break;
+        }
 
-        case 1:
-          if (is_gap(m_seq[x]))
-            ++lengthI;
-          else
-          {
-            if (not gappedy)
-              ++e->m_gaps;
-            ++e->m_gapn;
-            gappedx = false;
-            gappedy = true;
-          }
+        --x;
+        --y;
+        break;
+    }
+  }
 
-          m_residues[x].AddGap(e->m_distance);
-          --x;
-          break;
+  // update the new entry
+  e->m_identical = inAlignment.m_identical;
+  e->m_similar = inAlignment.m_similar;
+  e->m_length = inAlignment.m_length;
+  e->m_distance = 1 - float(e->m_identical) / e->m_length;
+  e->m_score = 1 - e->m_distance;
 
-        case 0:
-          e->m_aligned[x + xgaps] = kResidues[e->m_seq[y]];
-          m_residues[x].Add(e->m_seq[y], e->m_distance);
+  e->m_ifir = m_residues[pos(x + 1)].m_seq_nr;
+  e->m_jfir = y + 2;
 
-          if (not is_gap(e->m_seq[y]) and is_gap(m_seq[x]))
-          {
-            if (not gappedx)
-              ++e->m_gaps;
-            gappedx = true;
-            ++e->m_gapn;
-          }
-          else if (gappedx)
-          {
-            ++m_residues[x].m_ins;
-            gappedx = false;
-          }
+  e->m_stid = e->m_acc + '/' +
+    boost::lexical_cast<std::string>(e->m_jfir) + '-' +
+    boost::lexical_cast<std::string>(e->m_jlas);
 
-          if (gappedy)
-          {
-            ++m_residues[x].m_del;
-            gappedy = false;
-          }
+  e->m_column_mark = m_column_count;
 
-          --x;
-          --y;
-          break;
-      }
+  m_entries.push_back(e);
+
+  m_sum_dist_weight += e->m_distance;
+}
+
+void MProfile::Align(MHitPtr e, float inGapOpen, float inGapExtend)
+{
+  MAlignment alignment;
+  if (Align(e, inGapOpen, inGapExtend, alignment))
+    Commit(e, alignment);
+}
+
+// Columns are never removed and keep their relative order, so the columns
+// an entry knows about are exactly those with an id below its mark. All
+// others were inserted after the entry was accepted and are gaps for it.
+void MProfile::ExpandAlignments()
+{
+  foreach (MHitPtr e, m_entries)
+  {
+    if (e->m_aligned.length() == m_columns.size())
+      continue;
+
+    assert(e->m_aligned.length() == static_cast<size_t>(
+      count_if(m_columns.begin(), m_columns.end(),
+               [e](uint32 c) { return c < e->m_column_mark; })));
+
+    std::string aligned(m_columns.size(), '.');
+    std::string::const_iterator r = e->m_aligned.begin();
+    for (size_t i = 0; i < m_columns.size(); ++i)
+    {
+      if (m_columns[i] < e->m_column_mark)
+        aligned[i] = *r++;
     }
 
-    // update the new entry
-    e->m_identical = ident;
-    e->m_similar = similar;
-    e->m_length = length;
-    e->m_distance = 1 - float(ident) / length;
-    e->m_score = 1 - e->m_distance;
-
-    e->m_ifir = m_residues[x + 1].m_seq_nr;
-    e->m_jfir = y + 2;
-
-    e->m_stid = e->m_acc + '/' +
-      boost::lexical_cast<std::string>(e->m_jfir) + '-' +
-      boost::lexical_cast<std::string>(e->m_jlas);
-
-    m_entries.push_back(e);
-
-    m_sum_dist_weight += e->m_distance;
-
-//#if not defined(NDEBUG)
-//    if (dmp)
-//    {
-//      std::string s = decode(m_seq);
-//      for (std::string::size_type i = 72; i < s.length(); i += 73)
-//        s.insert(s.begin() + i, '\n');
-//
-//      cout << '>' << "PDB" << std::endl
-//         << s << std::endl;
-//
-//      foreach (MHitPtr e, m_entries)
-//        cout << *e;
-//      exit(1);
-//    }
-//#endif
+    e->m_aligned.swap(aligned);
   }
 }
 
@@ -892,29 +1146,6 @@ char map_value_to_char(double v)
   return map_value_to_char(static_cast<uint32>(v));
 }
 
-std::string FixedLengthString(const std::string &s, const uint64 length)
-{
-    std::string r(s);
-
-    if (s.length() < length)
-    {
-        r = r.insert(0, length - r.length(), ' ');
-    }
-    else if (s.length() > length)
-    {
-        r = std::string(length, '-');
-        r[length - 1] = '>';
-    }
-    return r;
-}
-
-std::string FixedLengthString(const int64 number, const uint64 length)
-{
-    std::string s = std::to_string(number);
-
-    return FixedLengthString(s, length);
-}
-
 void MProfile::PrintStockholm(std::ostream& os, const std::string& inChainID,
                               bool inFetchDBRefs) const
 {
@@ -927,6 +1158,8 @@ void MProfile::PrintStockholm(std::ostream& os, const std::string& inChainID,
 
   // ## per residue information
 
+  MLineBuffer line;
+
   uint32 nextNr = m_residues.front().m_seq_nr;
   os << "#=GF CC ## RESIDUE INFORMATION" << std::endl
      << "#=GF CC SeqNo   PDBNo AA STRUCTURE BP1 BP2  ACC  NOCC VAR CHAIN AUTHCHAIN     NUMBER     RESNUM        BP1        BP2"
@@ -937,24 +1170,31 @@ void MProfile::PrintStockholm(std::ostream& os, const std::string& inChainID,
       continue;
 
     if (ri.m_seq_nr != nextNr)
-      os << boost::format("#=GF RI %5.5d       ! !              0   0    0     0   0") % nextNr << std::endl;
+    {
+      line.Append("#=GF RI ").Right(nextNr, 5)
+          .Append("       ! !              0   0    0     0   0");
+      line.Write(os);
+    }
 
     uint32 ivar = uint32(100 * (1 - ri.m_consweight));
 
     char aa_code = GetAACode(ri.m_aa, ri.m_ss_bridge_nr),
          ins_code = (ri.m_ins_code.size() > 0)? ri.m_ins_code.at(0): ' ';
 
-    os << boost::format("#=GF RI %5.5s %5.5s%c%c %c %9.9s %4.4s%4.4s%5.5s %5.5d%4.4d")
-          % FixedLengthString(ri.m_seq_nr, 5) % FixedLengthString(ri.m_pdb_nr, 5) % ins_code % FixedLengthString(ri.m_chain_id, 1)
-          % aa_code % ri.m_structure
-          % FixedLengthString(ri.m_beta_partner_1, 4) % FixedLengthString(ri.m_beta_partner_2, 4)
-          % FixedLengthString(floor(ri.m_accessibility + 0.5), 5)
-          % ri.m_nocc % ivar;
-
-    os << boost::format("  %4.4s      %4.4s %10.10s %10.10s %10.10s %10.10s")
-          % ri.m_chain_id % ri.m_auth_chain_id
-          % FixedLengthString(ri.m_seq_nr, 10) % FixedLengthString(ri.m_pdb_nr, 10)
-          % FixedLengthString(ri.m_beta_partner_1, 10) % FixedLengthString(ri.m_beta_partner_2, 10) << std::endl;
+    line.Append("#=GF RI ").Clipped(ri.m_seq_nr, 5).Append(' ')
+        .Clipped(ri.m_pdb_nr, 5).Append(ins_code).Clipped(ri.m_chain_id, 1)
+        .Append(' ').Append(aa_code).Append(' ')
+        .Right(ri.m_structure, strnlen(ri.m_structure, sizeof(ri.m_structure)), 9)
+        .Append(' ').Clipped(ri.m_beta_partner_1, 4).Clipped(ri.m_beta_partner_2, 4)
+        .Clipped(int64(floor(ri.m_accessibility + 0.5)), 5)
+        .Append(' ').Right(ri.m_nocc, 5).Right(ivar, 4);
+
+    line.Append("  ").Right(ri.m_chain_id, 4)
+        .Append("      ").Right(ri.m_auth_chain_id, 4)
+        .Append(' ').Clipped(ri.m_seq_nr, 10).Append(' ').Clipped(ri.m_pdb_nr, 10)
+        .Append(' ').Clipped(ri.m_beta_partner_1, 10)
+        .Append(' ').Clipped(ri.m_beta_partner_2, 10);
+    line.Write(os);
 
     nextNr = ri.m_seq_nr + 1;
   }
@@ -970,25 +1210,33 @@ void MProfile::PrintStockholm(std::ostream& os, const std::string& inChainID,
       continue;
 
     if (ri.m_seq_nr != nextNr)
-      os << boost::format("#=GF PR %5.5d           0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0     0    0    0   0.000      0  1.00")
-        % nextNr << std::endl;
+    {
+      line.Append("#=GF PR ").Right(nextNr, 5)
+          .Append("           0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0   0     0    0    0   0.000      0  1.00");
+      line.Write(os);
+    }
 
     char chainChar = '>';
     if (ri.m_chain_id.length() <= 1)
         chainChar = ri.m_chain_id[0];
 
-    os << boost::format("#=GF PR %5.5d %5.5d%1.1s%1.1s") % ri.m_seq_nr % ri.m_pdb_nr % ri.m_ins_code % chainChar;
+    line.Append("#=GF PR ").Right(ri.m_seq_nr, 5).Append(' ').Right(ri.m_pdb_nr, 5)
+        .Right(ri.m_ins_code, 1).Append(chainChar);
 
     for (uint32 i = 0; i < 20; ++i)
-      os << boost::format("%4.4d") % uint32(100.0 * ri.m_freq[i] + 0.5);
+      line.Right(uint32(100.0 * ri.m_freq[i] + 0.5), 4);
 
     uint32 relent = uint32(100 * ri.m_entropy / log(20.0));
-    os << "  " << boost::format("%4.4d %4.4d %4.4d  %6.3f   %4.4d %5.2f") % ri.m_nocc % ri.m_del % ri.m_ins % ri.m_entropy % relent % ri.m_consweight;
+    line.Append("  ").Right(ri.m_nocc, 4).Append(' ').Right(ri.m_del, 4)
+        .Append(' ').Right(ri.m_ins, 4).Append("  ").Fixed(ri.m_entropy, 6, 3)
+        .Append("   ").Right(relent, 4).Append(' ').Fixed(ri.m_consweight, 5, 2);
 
-    os << boost::format("   %4.4s      %4.4s %10.10s %10.10s %10.10s %10.10s")
-          % ri.m_chain_id % ri.m_auth_chain_id
-          % FixedLengthString(ri.m_seq_nr, 10) % FixedLengthString(ri.m_pdb_nr, 10)
-          % FixedLengthString(ri.m_beta_partner_1, 10) % FixedLengthString(ri.m_beta_partner_2, 10) << std::endl;
+    line.Append("   ").Right(ri.m_chain_id, 4)
+        .Append("      ").Right(ri.m_auth_chain_id, 4)
+        .Append(' ').Clipped(ri.m_seq_nr, 10).Append(' ').Clipped(ri.m_pdb_nr, 10)
+        .Append(' ').Clipped(ri.m_beta_partner_1, 10)
+        .Append(' ').Clipped(ri.m_beta_partner_2, 10);
+    line.Write(os);
 
     nextNr = ri.m_seq_nr + 1;
   }
@@ -1003,8 +1251,6 @@ void MProfile::PrintStockholm(std::ostream& os, const std::string& inChainID,
 
   os << "#=GS " << inChainID << std::string(tl - inChainID.length(), ' ') << " CC The query chain" << std::endl;
 
-  boost::format fmt("#=GS %s HSSP score=%4.2f/%4.2f aligned=%d-%d/%d-%d length=%d ngaps=%d gaplen=%d seqlen=%d");
-
   std::map<std::string,std::vector<std::string>> linked;
 #ifdef HAVE_LIBZEEP
   if (inFetchDBRefs)
@@ -1023,10 +1269,17 @@ void MProfile::PrintStockholm(std::ostream& os, const std::string& inChainID,
     std::string id = e->m_stid + std::string(tl - e->m_stid.length(), ' ');
 
     os << "#=GS " << id << " ID " << e->m_id << std::endl
-       << "#=GS " << id << " DE " << e->m_def << std::endl
-       << fmt % id % e->m_score % (float(e->m_similar) / e->m_length)
-           % e->m_ifir % e->m_ilas % e->m_jfir % e->m_jlas % e->m_length
-           % e->m_gaps % e->m_gapn % e->m_seq.length() << std::endl;
+       << "#=GS " << id << " DE " << e->m_def << std::endl;
+
+    line.Append("#=GS ").Append(id).Append(" HSSP score=").Fixed(e->m_score, 4, 2)
+        .Append('/').Fixed(float(e->m_similar) / e->m_length, 4, 2)
+        .Append(" aligned=").Right(e->m_ifir, 0).Append('-').Right(e->m_ilas, 0)
+        .Append('/').Right(e->m_jfir, 0).Append('-').Right(e->m_jlas, 0)
+        .Append(" length=").Right(e->m_length, 0)
+        .Append(" ngaps=").Right(e->m_gaps, 0)
+        .Append(" gaplen=").Right(e->m_gapn, 0)
+        .Append(" seqlen=").Right(int64(e->m_seq.length()), 0);
+    line.Write(os);
 
 #ifdef HAVE_LIBZEEP
     if (inFetchDBRefs and not linked[e->m_id].empty())
@@ -1074,8 +1327,11 @@ void MProfile::PrintStockholm(std::ostream& os, const std::string& inChainID,
     }
 
     foreach (const MHitPtr e, m_entries)
-      os << e->m_stid << std::string(tl - e->m_stid.length() + 1, ' ')
-         << e->m_aligned.substr(o, n) << std::endl;
+    {
+      line.Append(e->m_stid).Append(' ', tl - e->m_stid.length() + 1)
+          .Append(e->m_aligned.c_str() + o, n);
+      line.Write(os);
+    }
 
     os << "#=GC SS          " << std::string(tl - 17 + 1, ' ') << ss
        << std::endl
@@ -1156,76 +1412,37 @@ void MProfile::PrintStockholm(std::ostream& os, const MProtein& inProtein,
 
 // --------------------------------------------------------------------
 
-void MProfile::Process(std::istream& inHits, float inGapOpen,
-                       float inGapExtend, uint32 inMaxHits, uint32 inThreads)
+void MProfile::Process(std::vector<BlastHit>& inHits, float inGapOpen,
+                       float inGapExtend, uint32 inMaxHits,
+                       MScheduler& inScheduler,
+                       uint32 inAlignWindow, uint32 inAlignStaleness,
+                       uint32 inDistanceBand)
 {
   std::vector<MHitPtr> hits;
+  hits.reserve(inHits.size());
 
-  std::string id, def, seq;
-  for (;;)
+  foreach (BlastHit& hit, inHits)
   {
-    std::string line;
-    getline(inHits, line);
-    if (line.empty() and inHits.eof())
-      break;
-
-    if (ba::starts_with(line, ">"))
-    {
-      if (not (id.empty() or seq.empty()))
-        hits.push_back(MHit::Create(id, def, seq));
-
-      id.clear();
-      def.clear();
-      seq.clear();
-
-      std::string::size_type s = line.find(' ');
-      if (s != std::string::npos)
-      {
-        id = line.substr(1, s - 1);
-        def = line.substr(s + 1);
-      }
-      else
-        id = line.substr(1);
-    }
-    else
-      seq += line;
+    if (not (hit.id.empty() or hit.seq.empty()))
+      hits.push_back(MHit::Create(hit));
   }
 
-  if (not (id.empty() or seq.empty()))
-    hits.push_back(MHit::Create(id, def, seq));
-
   // Now calculate distances
   MProgress p1(hits.size(), "distance");
 
-  boost::thread_group threads;
   MCounter ix(0);
 
-  for (uint32 t = 0; t < inThreads; ++t)
-    threads.create_thread([this, &ix, &hits, &p1]() {
-      for (;;)
-      {
-        uint64 next = ix++;
-        if (next >= hits.size())
-          break;
-
-        hits[next]->CalculateDistance(m_seq);
-        p1.Consumed(1);
-      }
-    });
-
-  threads.join_all();
-
-  // if we have way too many hits, take a random set
-  if (hits.size() > inMaxHits * 10 and inMaxHits > 0)
-  {
-    if (VERBOSE)
-      std::cerr << "dropping " << (hits.size() - 10 * inMaxHits) << " hits"
-                << std::endl;
+  inScheduler.Run(inScheduler.Size(), [this, &ix, &hits, &p1, inDistanceBand](uint32) {
+    for (;;)
+    {
+      uint64 next = ix++;
+      if (next >= hits.size())
+        break;
 
-    random_shuffle(hits.begin(), hits.end());
-    hits.erase(hits.begin() + inMaxHits * 10, hits.end());
-    m_shuffled = true;
-  }
+      hits[next]->CalculateDistance(m_seq, inDistanceBand);
+      p1.Consumed(1);
+    }
+  });
 
   // sort them by distance
   sort(hits.begin(), hits.end(), [](const MHitPtr a, const MHitPtr b) -> bool {
@@ -1234,70 +1451,152 @@ void MProfile::Process(std::istream& inHits, float inGapOpen,
 
   // and then align all the hits
   MProgress p2(hits.size(), "aligning");
-  foreach (MHitPtr e, hits)
+  if (inScheduler.Size() <= 1 or inAlignWindow <= 1)
+  {
+    foreach (MHitPtr e, hits)
+    {
+      Align(e, inGapOpen, inGapExtend);
+      p2.Consumed(1);
+    }
+  }
+  else
   {
-    Align(e, inGapOpen, inGapExtend);
-    p2.Consumed(1);
+    // Align a window of hits in parallel against the current profile and
+    // commit the accepted ones in order. Once more than inAlignStaleness
+    // hits were added to the profile, the remaining alignments in the window
+    // are out of date and a new window is started. With a staleness of zero
+    // the result is the same as aligning the hits one by one.
+    std::vector<MAlignment> alignments(inAlignWindow);
+    std::vector<char> accepted(inAlignWindow);
+
+    size_t first = 0;
+    while (first < hits.size())
+    {
+      size_t n = std::min<size_t>(inAlignWindow, hits.size() - first);
+
+      MCounter ix(0);
+
+      inScheduler.Run(std::min<size_t>(inScheduler.Size(), n), [&, this](uint32) {
+        for (;;)
+        {
+          uint64 next = ix++;
+          if (next >= n)
+            break;
+
+          accepted[next] = Align(hits[first + next], inGapOpen, inGapExtend,
+                                 alignments[next]);
+        }
+      });
+
+      size_t revision = m_entries.size(), i = 0;
+      while (i < n and m_entries.size() - revision <= inAlignStaleness)
+      {
+        if (accepted[i])
+          Commit(hits[first + i], alignments[i]);
+        ++i;
+        p2.Consumed(1);
+      }
+
+      first += i;
+    }
   }
 
   // now if we have too many entries, take a random set
   if (m_entries.size() > inMaxHits and inMaxHits > 0)
   {
-    random_shuffle(m_entries.begin(), m_entries.end());
+    Shuffle(m_entries);
     m_entries.erase(m_entries.begin() + inMaxHits, m_entries.end());
-    m_shuffled = true;
   }
 
+  // conservation and output need the full width alignments
+  ExpandAlignments();
+
   // sort by score
   sort(m_entries.begin(), m_entries.end(),
        [](const MHitPtr a, const MHitPtr b) -> bool {
     return a->m_score > b->m_score;
   });
 
-  CalculateConservation(inThreads);
+  CalculateConservation(inScheduler);
 }
 
 // --------------------------------------------------------------------
 
 // Find the minimal set of overlapping sequences
 // In case of strong similarity (distance <= 0.01) we take the longest chain.
-void ClusterSequences(const std::vector<sequence>& s, std::vector<size_t>& ix)
+void ClusterSequences(const std::vector<sequence>& s, std::vector<size_t>& ix,
+                      MScheduler& inScheduler)
 {
+  // Chains with identical sequences are found by hashing, cls holds the
+  // index of the first chain with the same sequence.
+  std::vector<size_t> cls(s.size());
+  std::unordered_map<sequence, size_t, boost::hash<sequence>> first;
+  for (size_t i = 0; i < s.size(); ++i)
+    cls[i] = first.insert(std::make_pair(s[i], i)).first->second;
+
+  // Calculate the distance for each (ordered) pair of different sequences
+  // that occurs, only once and in parallel.
+  std::vector<std::pair<size_t,size_t>> pairs;
+  for (size_t i = 0; i + 1 < s.size(); ++i)
+  {
+    for (size_t j = i + 1; j < s.size(); ++j)
+    {
+      if (cls[i] != cls[j])
+        pairs.push_back(std::make_pair(cls[i], cls[j]));
+    }
+  }
+
+  sort(pairs.begin(), pairs.end());
+  pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+
+  std::vector<char> similar(pairs.size(), false);
+
+  MCounter next(0);
+
+  inScheduler.Run(std::min<size_t>(inScheduler.Size(), pairs.size()), [&](uint32) {
+    for (;;)
+    {
+      uint64 k = next++;
+      if (k >= pairs.size())
+        break;
+
+      const sequence& a = s[pairs[k].first];
+      const sequence& b = s[pairs[k].second];
+
+      float d = calculateDistance(a, b);
+      // rescale distance to shortest length:
+      d = 1 - (1 - d) * std::max(a.length(), b.length()) / std::min(a.length(), b.length());
+      similar[k] = (d <= 0.01);
+    }
+  });
+
+  // Each chain not taken yet takes all following chains similar to it.
   std::vector<bool> skip(s.size(), false);
 
-  for (;;)
+  for (size_t i = 0; i + 1 < s.size(); ++i)
   {
-    bool found = false;
-    for (uint32 i = 0; not found and i < s.size() - 1; ++i)
-    {
-      for (uint32 j = i + 1; not found and j < s.size(); ++j)
-      {
-        if (skip[i] or skip[j])
-          continue;
+    if (skip[i])
+      continue;
 
-        const sequence& a = s[i];
-        const sequence& b = s[j];
+    for (size_t j = i + 1; j < s.size(); ++j)
+    {
+      if (skip[j])
+        continue;
 
-        bool isSame = a == b;
-        if (not isSame)
-        {
-          float d = calculateDistance(a, b);
-          // rescale distance to shortest length:
-          d = 1 - (1 - d) * std::max(a.length(), b.length()) / std::min(a.length(), b.length());
-          isSame = (d <= 0.01);
-        }
+      bool isSame = cls[i] == cls[j];
+      if (not isSame)
+      {
+        auto p = lower_bound(pairs.begin(), pairs.end(),
+                             std::make_pair(cls[i], cls[j]));
+        isSame = similar[p - pairs.begin()];
+      }
 
-        if (isSame)
-        {
-          skip[j] = true;
-          ix[j] = i;
-          found = true;
-        }
+      if (isSame)
+      {
+        skip[j] = true;
+        ix[j] = i;
       }
     }
-
-    if (not found)
-      break;
   }
 
   // change ix entries to make sure we use only the longest chains
@@ -1321,95 +1620,158 @@ void ClusterSequences(const std::vector<sequence>& s, std::vector<size_t>& ix)
 // Calculate the variability of a residue, based on dayhoff similarity
 // and weights
 
-std::pair<const char*,uint32> kSentinel((const char*)nullptr, 0);
+// The alignment is compared as rows of codes, the residue number for
+// residues and kGapCode for gaps. The aligned strings only contain the
+// letters in kResidues and gaps, so comparing codes is the same as
+// comparing the characters.
+
+const uint8 kGapCode = 24;
 
-void CalculateConservation(buffer<std::pair<const char*,uint32>>& b,
-                           const std::vector<MHitPtr>& inHits,
-                           std::vector<float>& sumvar,
-                           std::vector<float>& sumdist)
+inline uint8 conservation_code(char c)
 {
-  size_t length = sumvar.size();
-  std::vector<float> simval(length);
+  return is_gap(c) ? kGapCode : ResidueNr(c);
+}
 
-  for (;;)
+// Dayhoff similarity for each pair of codes. Pairs that do not count for
+// the conservation (gaps, X, Z and such) have a similarity and weight of
+// zero, so they can be summed without testing.
+struct MSimilarityTable
+{
+  MSimilarityTable()
   {
-    auto next = b.get();
-    if (next == kSentinel)
-      break;
-
-    const char* si = next.first;
-    for (uint32 j = next.second; j < inHits.size(); ++j)
+    for (uint32 a = 0; a < 32; ++a)
     {
-      const char* sj = inHits[j]->m_aligned.c_str();
-
-      uint32 len = 0, agr = 0;
-      for (uint32 k = 0; k < length; ++k)
+      for (uint32 b = 0; b < 32; ++b)
       {
-        simval[k] = std::numeric_limits<float>::min();
+        bool counts = a <= 20 and b <= 20;
+        m_similarity[a * 32 + b] = counts ? score(kDayhoffData, a, b) : 0;
+        m_weight[a * 32 + b] = counts ? 1 : 0;
+      }
+    }
+  }
+
+  float m_similarity[32 * 32];
+  float m_weight[32 * 32];
+};
 
-        if (is_gap(si[k]) or is_gap(sj[k]))
-          continue;
+// Compare the rows in [inFirstI, inLastI) with the rows in [inFirstJ, inLastJ)
+// that come after them, returns the number of pairs compared.
+uint64 CalculateConservation(const std::vector<uint8>& inRows,
+                             uint32 inFirstI, uint32 inLastI,
+                             uint32 inFirstJ, uint32 inLastJ,
+                             std::vector<float>& sumvar,
+                             std::vector<float>& sumdist)
+{
+  static const MSimilarityTable kTable;
 
-        ++len;
-        if (si[k] == sj[k])
-          ++agr;
+  size_t length = sumvar.size();
+  float* var = &sumvar[0];
+  float* dist = &sumdist[0];
+  uint64 pairs = 0;
 
-        int8 ri = ResidueNr(si[k]);
-        int8 rj = ResidueNr(sj[k]);
+  for (uint32 i = inFirstI; i < inLastI; ++i)
+  {
+    const uint8* si = &inRows[i * length];
+    for (uint32 j = std::max(inFirstJ, i + 1); j < inLastJ; ++j)
+    {
+      const uint8* sj = &inRows[j * length];
+      ++pairs;
 
-        if (ri <= 20 and rj <= 20)
-          simval[k] = score(kDayhoffData, ri, rj);
+      // branch free, so the compiler can vectorise it
+      uint32 len = 0, agr = 0;
+      for (uint32 k = 0; k < length; ++k)
+      {
+        uint32 both = (si[k] != kGapCode) & (sj[k] != kGapCode);
+        len += both;
+        agr += both & (si[k] == sj[k]);
       }
 
       if (len == 0)
         continue;
 
       float distance = 1 - (float(agr) / float(len));
+      float weight = distance * 1.5f;
       for (uint32 k = 0; k < length; ++k)
       {
-        if (simval[k] != std::numeric_limits<float>::min())
-        {
-          sumvar[k] += distance * simval[k];
-          sumdist[k] += distance * 1.5f;
-        }
+        uint32 pair = si[k] * 32 + sj[k];
+        var[k] += distance * kTable.m_similarity[pair];
+        dist[k] += weight * kTable.m_weight[pair];
       }
     }
   }
 
-  b.put(kSentinel);
+  return pairs;
 }
 
-void MProfile::CalculateConservation(uint32 inThreads)
+void MProfile::CalculateConservation(MScheduler& inScheduler)
 {
   std::vector<float> sumvar(m_seq.length(), 0), sumdist(m_seq.length(), 0);
 
-  // Calculate conservation weights in multiple threads to gain speed.
-  buffer<std::pair<const char*,uint32>> b;
-  boost::thread_group threads;
-  boost::mutex sumLock;
-
-  for (uint32 t = 0; t < inThreads; ++t)
-    threads.create_thread([&]() {
-      std::vector<float> csumvar(sumvar.size(), 0), csumdist(sumdist.size(), 0);
-
-      HSSP::CalculateConservation(b, m_entries, csumvar, csumdist);
-
-      // accumulate our data
-      boost::mutex::scoped_lock l(sumLock);
+  // encode the alignment, the query first
+  size_t length = m_seq.length();
+  uint32 rows = static_cast<uint32>(m_entries.size() + 1);
+  std::vector<uint8> codes(rows * length);
 
-      for (size_t i = 0; i < sumvar.size(); ++i)
-      {
-        sumvar[i] += csumvar[i];
-        sumdist[i] += csumdist[i];
-      }
-    });
+  std::string s(decode(m_seq));
+  transform(s.begin(), s.end(), codes.begin(), conservation_code);
+  for (uint32 i = 0; i < m_entries.size(); ++i)
+  {
+    assert(m_entries[i]->m_aligned.length() == length);
+    transform(m_entries[i]->m_aligned.begin(), m_entries[i]->m_aligned.end(),
+              codes.begin() + (i + 1) * length, conservation_code);
+  }
 
-  int64 N = (m_entries.size() * (m_entries.size() + 1)) / 2;
+  int64 N = (static_cast<int64>(rows) * (rows - 1)) / 2;
   if (m_shuffled)
     N += m_seq.length();
 
   MProgress p(N, "conservation");
 
+  // Split the triangle of pairs into tiles of two blocks of rows that
+  // together fit in the cache. Each row of a block is compared to each
+  // row in the other, so the rows are read from memory once per tile.
+  const size_t kBlockBytes = 64 * 1024;
+  uint32 blockSize = static_cast<uint32>(
+      std::max<size_t>(8, kBlockBytes / std::max<size_t>(length, 1)));
+
+  std::vector<std::pair<uint32,uint32>> tiles;
+  for (uint32 bi = 0; bi < rows; bi += blockSize)
+  {
+    for (uint32 bj = bi; bj < rows; bj += blockSize)
+      tiles.push_back(std::make_pair(bi, bj));
+  }
+
+  // Calculate conservation weights in multiple tasks to gain speed.
+  // Tasks take the next tile using a counter and sum in their own
+  // vectors, these are added up when they are done.
+  boost::mutex sumLock;
+  MCounter ix(0);
+
+  inScheduler.Run(inScheduler.Size(), [&](uint32) {
+    std::vector<float> csumvar(sumvar.size(), 0), csumdist(sumdist.size(), 0);
+
+    for (;;)
+    {
+      uint64 next = ix++;
+      if (next >= tiles.size())
+        break;
+
+      uint32 bi = tiles[next].first, bj = tiles[next].second;
+      p.Consumed(HSSP::CalculateConservation(codes,
+        bi, std::min(bi + blockSize, rows),
+        bj, std::min(bj + blockSize, rows), csumvar, csumdist));
+    }
+
+    // accumulate our data
+    boost::mutex::scoped_lock l(sumLock);
+
+    for (size_t i = 0; i < sumvar.size(); ++i)
+    {
+      sumvar[i] += csumvar[i];
+      sumdist[i] += csumdist[i];
+    }
+  });
+
   if (m_shuffled)  // need to recalculate m_dist[] and m_nocc
   {
     for (uint32 i = 0; i < m_seq.length(); ++i)
@@ -1434,20 +1796,6 @@ void MProfile::CalculateConservation(uint32 inThreads)
     }
   }
 
-  std::string s(decode(m_seq));
-  b.put(std::make_pair(s.c_str(), 0));
-
-  p.Consumed(m_entries.size());
-
-  for (uint32 i = 0; i + 1 < m_entries.size(); ++i)
-  {
-    b.put(std::make_pair(m_entries[i]->m_aligned.c_str(), i + 1));
-    p.Consumed(m_entries.size() - i);
-  }
-
-  b.put(kSentinel);
-  threads.join_all();
-
   for (uint32 i = 0; i < m_seq.length(); ++i)
   {
     MResInfo& ri = m_residues[i];
@@ -1480,7 +1828,9 @@ void CreateHSSP(const MProtein& inProtein,
                 const std::vector<fs::path>& inDatabanks,
                 uint32 inMaxHits, uint32 inMinSeqLength, float inGapOpen,
                 float inGapExtend, float inThreshold, float inFragmentCutOff,
-                uint32 inThreads, bool inFetchDBRefs, std::ostream& inOs)
+                MScheduler& inScheduler, uint32 inAlignWindow,
+                uint32 inAlignStaleness, uint32 inDistanceBand,
+                uint32 inSeed, bool inFetchDBRefs, std::ostream& inOs)
 {
   // construct a set of unique sequences, containing only the largest ones in
   // case of overlap
@@ -1508,7 +1858,7 @@ void CreateHSSP(const MProtein& inProtein,
     throw mas_exception(boost::format("Not enough sequences in PDB file of length %1%") % inMinSeqLength);
 
   if (seqset.size() > 1)
-    ClusterSequences(seqset, ix);
+    ClusterSequences(seqset, ix, inScheduler);
 
   // only take the unique sequences
   for (size_t i = 0; i < ix.size(); ++i)
@@ -1523,38 +1873,86 @@ void CreateHSSP(const MProtein& inProtein,
   foreach (size_t i, ix)
     used.push_back(chains[i]->GetChainID());
 
-  bool empty = true;
+  // Process the unique chains concurrently, so the serial parts of one
+  // overlap with the parallel parts of another. The Stockholm output is
+  // collected per chain and written in order.
+  uint32 n = static_cast<uint32>(ix.size());
+  uint32 concurrent = std::max(1U, std::min(n, inScheduler.Size()));
 
-  foreach (size_t i, ix)
-  {
-    const MChain& chain(*chains[i]);
+  std::vector<std::string> output(n);
+  std::vector<std::exception_ptr> errors(n);
+  MRandomTurn turn(n);
 
-    // do a blast search for inMaxHits * 4 hits.
-    std::vector<char> blastHits;
+  MCounter next(0);
 
-    io::filtering_ostream out(io::back_inserter(blastHits));
+  inScheduler.Run(concurrent, [&](uint32) {
+    for (;;)
+    {
+      uint64 k = next++;
+      if (k >= n)
+        break;
 
-    //ifstream f("1F88-A-hits.fa");
-    //io::copy(f, out);
+      size_t i = ix[k];
 
-    std::string seq = decode(seqset[i]);
-    SearchAndWriteResultsAsFastA(out, inDatabanks, seq,
-      "blastp", "BLOSUM62", 3, 10, true, true, -1, -1, 0, inThreads);
-    out.flush();
+      try
+      {
+        const MChain& chain(*chains[i]);
 
-    if (blastHits.empty())
-      continue;
+        // do a blast search, if there are way too many hits it keeps a
+        // random set of inMaxHits * 10
+        std::vector<BlastHit> blastHits;
 
-    MProfile profile(chain, seqset[i], inThreshold, inFragmentCutOff);
+        std::string seq = decode(seqset[i]);
+        bool sampled = SearchForHits(blastHits, inDatabanks, seq,
+          "blastp", "BLOSUM62", 3, 10, true, true, -1, -1, 0,
+          inMaxHits * 10, inSeed, inScheduler);
 
-    io::filtering_istream in(boost::make_iterator_range(blastHits));
-    profile.Process(in, inGapOpen, inGapExtend, inMaxHits, inThreads);
+        if (VERBOSE and sampled)
+          std::cerr << "kept a random set of " << blastHits.size()
+                    << " hits" << std::endl;
 
-    if (profile.m_entries.empty())
+        if (not blastHits.empty())
+        {
+          MProfile profile(chain, seqset[i], inThreshold, inFragmentCutOff);
+          profile.m_shuffled = sampled;
+          profile.m_turn = &turn;
+          profile.m_turn_nr = static_cast<uint32>(k);
+
+          profile.Process(blastHits, inGapOpen, inGapExtend, inMaxHits,
+                          inScheduler, inAlignWindow, inAlignStaleness,
+                          inDistanceBand);
+          turn.Done(static_cast<uint32>(k));
+
+          if (not profile.m_entries.empty())
+          {
+            std::ostringstream os;
+            profile.PrintStockholm(os, inProtein, inFetchDBRefs, used,
+                                   aka[i]);
+            output[k] = os.str();
+          }
+        }
+      }
+      catch (...)
+      {
+        errors[k] = std::current_exception();
+      }
+
+      turn.Done(static_cast<uint32>(k));
+    }
+  });
+
+  bool empty = true;
+
+  for (uint32 k = 0; k < n; ++k)
+  {
+    if (errors[k])
+      std::rethrow_exception(errors[k]);
+
+    if (output[k].empty())
       continue;
 
     empty = false;
-    profile.PrintStockholm(inOs, inProtein, inFetchDBRefs, used, aka[i]);
+    inOs << output[k];
   }
 
   if (empty)
@@ -1567,23 +1965,16 @@ void CreateHSSP(const std::string& inProtein,
                 const std::vector<fs::path>& inDatabanks,
                 uint32 inMaxHits,
                 uint32 inMinSeqLength, float inGapOpen, float inGapExtend,
-                float inThreshold, float inFragmentCutOff, uint32 inThreads,
-                bool inFetchDBRefs, std::ostream& inOs)
+                float inThreshold, float inFragmentCutOff,
+                MScheduler& inScheduler,
+                uint32 inAlignWindow, uint32 inAlignStaleness,
+                uint32 inDistanceBand, uint32 inSeed, bool inFetchDBRefs,
+                std::ostream& inOs)
 {
-  MChain* chain = new MChain("A");
-  std::vector<MResidue*>& residues = chain->GetResidues();
-  MResidue* last = nullptr;
-  int32 nr = 1;
-  foreach (char r, inProtein)
-  {
-    residues.push_back(new MResidue(nr, r, last));
-    ++nr;
-    last = residues.back();
-  }
-
-  MProtein protein("INPUT", chain);
+  MProtein protein("INPUT", inProtein);
   CreateHSSP(protein, inDatabanks, inMaxHits, inMinSeqLength, inGapOpen,
-             inGapExtend, inThreshold, inFragmentCutOff, inThreads,
+             inGapExtend, inThreshold, inFragmentCutOff, inScheduler,
+             inAlignWindow, inAlignStaleness, inDistanceBand, inSeed,
              inFetchDBRefs, inOs);
 }
 
@@ -11,6 +11,7 @@
 
 
 class MProtein;
+class MScheduler;
 
 namespace HSSP
 {
@@ -20,14 +21,16 @@ extern const float kThreshold, kFragmentCutOff;
 void CreateHSSP(const MProtein& inProtein,
   const std::vector<boost::filesystem::path>& inDatabanks,
   uint32 inMaxhits, uint32 inMinSeqLength, float inGapOpen, float inGapExtend,
-  float inThreshold, float inFragmentCutOff, uint32 inThreads,
-  bool inFetchDBRefs, std::ostream& inOutStream);
+  float inThreshold, float inFragmentCutOff, MScheduler& inScheduler,
+  uint32 inAlignWindow, uint32 inAlignStaleness, uint32 inDistanceBand,
+  uint32 inSeed, bool inFetchDBRefs, std::ostream& inOutStream);
 
 void CreateHSSP(const std::string& inProtein,
   const std::vector<boost::filesystem::path>& inDatabanks,
   uint32 inMaxhits, uint32 inMinSeqLength, float inGapOpen, float inGapExtend,
-  float inThreshold, float inFragmentCutOff, uint32 inThreads,
-  bool inFetchDBRefs, std::ostream& inOutStream);
+  float inThreshold, float inFragmentCutOff, MScheduler& inScheduler,
+  uint32 inAlignWindow, uint32 inAlignStaleness, uint32 inDistanceBand,
+  uint32 inSeed, bool inFetchDBRefs, std::ostream& inOutStream);
 
 }
 
@@ -23,7 +23,9 @@
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/regex.hpp>
 
+#include "block-compressor.h"
 #include "mas.h"
+#include "scheduler.h"
 #include "utils.h"
 
 #include "hssp-convert-3to1.h"
@@ -45,7 +47,8 @@ int main(int argc, char* const argv[])
       ("input,i", po::value<std::string>(), "Input PDB file (or PDB ID)")
       ("output,o",
        po::value<std::string>(),
-       "Output file, use 'stdout' to output to screen")
+       "Output file, optionally compressed by gzip (.gz) or bzip2 (.bz2), use 'stdout' to output to screen")
+      ("threads,a", po::value<uint32>(), "Number of threads used to compress the output (default is maximum)")
       ("version", "Show version number");
 
     po::positional_options_description p;
@@ -76,6 +79,14 @@ int main(int argc, char* const argv[])
       std::cerr << desc << std::endl;
       exit(1);
     }
+    uint32 threads = boost::thread::hardware_concurrency();
+    if (vm.count("threads"))
+      threads = vm["threads"].as<uint32>();
+    if (threads < 1)
+      threads = 1;
+
+    MScheduler scheduler(threads);
+
     io::filtering_stream<io::input> in;
     fs::ifstream ifs;
 
@@ -114,15 +125,11 @@ int main(int argc, char* const argv[])
 
       io::filtering_stream<io::output> out;
 
-#ifdef HAVE_LIBBZ2
-      if (output.extension() == ".bz2")
-        out.push(io::bzip2_compressor());
-#endif
-#ifdef HAVE_LIBZ
-      if (output.extension() == ".gz")
-        out.push(io::gzip_compressor());
-#endif
-      out.push(ofs);
+      MCompression compression = CompressionForFile(output.string());
+      if (compression != eCompressNone)
+        out.push(MBlockCompressor(ofs, compression, scheduler));
+      else
+        out.push(ofs);
 
       ConvertHsspFile(in, out);
     }
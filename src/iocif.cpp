@@ -7,6 +7,7 @@
 #include <boost/iostreams/copy.hpp>
 #include <boost/iostreams/device/back_inserter.hpp>
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
@@ -21,6 +22,12 @@ namespace ba = boost::algorithm;
 namespace mmCIF
 {
 
+// the white space of isspace in the C locale, without the call into the C library
+inline bool is_white(char ch)
+{
+  return ch == ' ' or (ch >= '\t' and ch <= '\r');
+}
+
 // skip routines to quickly position character pointer p at a next interesting location
 const char* skip_line(const char* p, const char* end);
 // skip over white-space and comments
@@ -43,6 +50,37 @@ std::string row::operator[](const char* inName) const
   return result;
 }
 
+int64 field::as_int() const
+{
+  boost::string_ref t = text();
+
+  const char* p = t.begin();
+  bool negate = false;
+  if (p != t.end() and (*p == '-' or *p == '+'))
+    negate = *p++ == '-';
+
+  if (p == t.end())
+    throw mas_exception(boost::format("invalid integer value '%1%'") % t);
+
+  int64 result = 0;
+  for (; p != t.end(); ++p)
+  {
+    if (not isdigit(*p))
+      throw mas_exception(boost::format("invalid integer value '%1%'") % t);
+    result = 10 * result + (*p - '0');
+  }
+
+  return negate ? -result : result;
+}
+
+const field& row::column(int32 inColumn) const
+{
+  static const char kEmpty[] = "";
+  static const field kEmptyField = { kEmpty, kEmpty, kEmpty, kEmpty };
+
+  return inColumn < 0 ? kEmptyField : m_fields[inColumn];
+}
+
 row record::front() const
 {
   row result;
@@ -61,7 +99,7 @@ row record::front() const
       field field = {};
 
       field.m_name = p = p + m_name.length() + 1;
-      while (p != m_end and not isspace(*p))
+      while (p != m_end and not is_white(*p))
         ++p;
 
       field.m_name_end = p;
@@ -87,7 +125,7 @@ row record::front() const
 
       field field;
       field.m_name = p = p + m_name.length() + 1;
-      while (p != m_end and not isspace(*p))
+      while (p != m_end and not is_white(*p))
         ++p;
 
       field.m_name_end = p;
@@ -147,6 +185,25 @@ void record::advance(row& row) const
   }
 }
 
+int32 record::column(const char* inName) const
+{
+  int32 result = -1;
+
+  row first = front();
+  for (uint32 i = 0; i < first.m_fields.size(); ++i)
+  {
+    const field& f = first.m_fields[i];
+    if (f.m_name_end - f.m_name == int32(strlen(inName)) and
+        strncmp(inName, f.m_name, f.m_name_end - f.m_name) == 0)
+    {
+      result = i;
+      break;
+    }
+  }
+
+  return result;
+}
+
 std::string record::get_joined(const char* inName,
                                const char* inDelimiter) const
 {
@@ -169,11 +226,219 @@ file::file(std::istream& is)
 
   io::copy(is, io::back_inserter(m_buffer));
 
-  m_data = &m_buffer[0];
-  m_end = m_data + m_buffer.size();
+  parse();
+}
+
+// The stream is read line by line, each line goes to the category of the
+// item or loop it belongs to. Kept categories are copied to m_buffer and
+// parsed at the end. The streamed loop collects its names and a batch of
+// lines, the complete rows of a batch are handed out as a record.
+
+namespace
+{
+
+bool starts_with(const char* p, const char* end, const char* inText)
+{
+  size_t n = strlen(inText);
+  return size_t(end - p) >= n and strncmp(p, inText, n) == 0;
+}
+
+}
+
+file::file(std::istream& is, const std::vector<std::string>& inCategories,
+           const std::string& inStreamed,
+           const std::function<void(const record&)>& inRows,
+           size_t inBatchSize)
+{
+  enum { eSkip, eKeep, eStream } route = eSkip;
+
+  std::string category;
+  bool loop = false,        // after loop_, before its first name
+       loop_category = false,  // the current category is a loop
+       names = false,       // reading the names of a loop
+       text = false,        // inside a text field
+       streamed_items = false;  // inStreamed is not a loop after all
+
+  std::vector<char> batch;
+  size_t names_size = 0;
+  uint32 field_count = 0;
+
+  auto flush = [&]()
+  {
+    batch.push_back(0);  // skip_value may look past the end
+
+    const char* start = &batch[0];
+    const char* end = start + batch.size() - 1;
+
+    // find the end of the last complete row
+    const char* p = start + names_size;
+    const char* row_end = p;
+    uint32 n = 0;
+    for (;;)
+    {
+      p = skip_white(p, end);
+      if (p >= end)
+        break;
+      p = skip_value(p, end);
+      if (++n == field_count)
+      {
+        n = 0;
+        row_end = p;
+      }
+    }
+
+    if (row_end > start + names_size)
+    {
+      record rows = { start, row_end, true, field_count, category };
+      inRows(rows);
+    }
+
+    size_t rows_size = row_end - start;
+    batch.pop_back();
+    batch.erase(batch.begin() + names_size, batch.begin() + rows_size);
+  };
+
+  auto kept = [&](const std::string& inName) -> bool
+  {
+    return std::find(inCategories.begin(), inCategories.end(), inName) != inCategories.end();
+  };
+
+  MLineReader reader(is);
+  const char* b;
+  const char* e;
+
+  if (not reader.Next(b, e) or not starts_with(b, e, "data_"))
+    throw mas_exception("Is this an mmCIF file?");
+
+  m_buffer.assign(b, e);
+  m_buffer.push_back('\n');
+
+  while (reader.Next(b, e))
+  {
+    if (text)
+    {
+      if (b != e and *b == ';')
+        text = false;
+    }
+    else if (b != e and *b == ';')
+    {
+      text = true;
+      names = false;
+    }
+    else
+    {
+      const char* p = skip_white(b, e);
+
+      if (p == e)  // empty line or comment
+        continue;
 
+      if (starts_with(p, e, "loop_"))
+      {
+        if (route == eStream)
+          flush();
+
+        loop = true;
+        names = false;
+        route = eSkip;
+        continue;
+      }
+
+      if (starts_with(p, e, "data_"))
+        throw mas_exception("Multiple data blocks in CIF file");
+
+      if (*p == '_')
+      {
+        const char* n = b = p;
+        while (n != e and *n != '.' and not is_white(*n))
+          ++n;
+        std::string name(p, n);
+
+        if (loop)  // the first name of a loop
+        {
+          loop = false;
+          loop_category = true;
+          names = true;
+          category = name;
+
+          if (name == inStreamed)
+          {
+            route = eStream;
+            batch.clear();
+            names_size = 0;
+            field_count = 0;
+          }
+          else if (kept(name))
+          {
+            route = eKeep;
+            m_buffer.insert(m_buffer.end(), "loop_\n", "loop_\n" + 6);
+          }
+          else
+            route = eSkip;
+        }
+        else if (not names or name != category)  // an item outside a loop
+        {
+          if (route == eStream)
+            flush();
+
+          names = false;
+
+          if (loop_category or name != category)
+          {
+            loop_category = false;
+            category = name;
+
+            if (name == inStreamed)
+              streamed_items = true;
+            route = kept(name) or name == inStreamed ? eKeep : eSkip;
+          }
+        }
+      }
+      else
+        names = false;
+    }
+
+    switch (route)
+    {
+      case eKeep:
+        m_buffer.insert(m_buffer.end(), b, e);
+        m_buffer.push_back('\n');
+        break;
+
+      case eStream:
+        batch.insert(batch.end(), b, e);
+        batch.push_back('\n');
+
+        if (names)
+        {
+          names_size = batch.size();
+          ++field_count;
+        }
+        else if (not text and batch.size() - names_size >= inBatchSize)
+          flush();
+        break;
+
+      case eSkip:
+        break;
+    }
+  }
+
+  if (route == eStream)
+    flush();
+
+  parse();
+
+  // a single row is written as items instead of a loop
+  if (streamed_items)
+    inRows(operator[](inStreamed.c_str()));
+}
+
+void file::parse()
+{
   m_buffer.push_back(0); // end with a null character, makes coding easier
 
+  m_data = &m_buffer[0];
+  m_end = m_data + m_buffer.size() - 1;
+
   // CIF files are simple to parse
 
   const char* p = m_data;
@@ -188,7 +453,7 @@ file::file(std::istream& is)
 
   while (p < m_end)
   {
-    if (isspace(*p))  // skip over white space
+    if (is_white(*p))  // skip over white space
     {
       ++p;
       continue;
@@ -200,7 +465,7 @@ file::file(std::istream& is)
       continue;
     }
 
-    if (strncmp(p, "loop_", 5) == 0)
+    if (*p == 'l' and strncmp(p, "loop_", 5) == 0)
     {
       if (not m_records.empty() and m_records.back().m_end == nullptr)
         m_records.back().m_end = p;
@@ -217,7 +482,7 @@ file::file(std::istream& is)
     if (*p == '_')  // a label
     {
       // scan for first dot
-      bool newName = loop;
+      bool newName = loop or m_records.empty();
       const char* n = rec.m_start;
 
       for (;;)
@@ -228,7 +493,7 @@ file::file(std::istream& is)
         ++p;
         ++n;
 
-        if (p == m_end or *p == '.' or isspace(*p))
+        if (p == m_end or *p == '.' or is_white(*p))
           break;
       }
 
@@ -252,7 +517,7 @@ file::file(std::istream& is)
           m_records.back().m_field_count += 1;
 
         // skip over field name
-        while (p != m_end and not isspace(*p))
+        while (p != m_end and not is_white(*p))
           ++p;
       }
       else
@@ -295,7 +560,7 @@ file::file(std::istream& is)
 
 
     // check for a new data_ block
-    if (p != m_end and strncmp(p, "data_", 5) == 0)
+    if (p != m_end and *p == 'd' and strncmp(p, "data_", 5) == 0)
       throw mas_exception("Multiple data blocks in CIF file");
   }
 
@@ -366,7 +631,7 @@ const char* skip_white(const char* p, const char* end)
 {
   while (p != end)
   {
-    if (isspace(*p))
+    if (is_white(*p))
     {
       ++p;
       continue;
@@ -389,7 +654,7 @@ const char* skip_value(const char* p, const char* end)
 {
   for (;;)
   {
-    if (isspace(*p))
+    if (is_white(*p))
     {
       ++p;
       continue;
@@ -404,14 +669,14 @@ const char* skip_value(const char* p, const char* end)
 
     if (*p == '\'')
     {
-      do ++p; while (p != end and not (*p == '\'' and isspace(*(p + 1))));
+      do ++p; while (p != end and not (*p == '\'' and is_white(*(p + 1))));
       ++p;
       break;
     }
 
     if (*p == '\"')
     {
-      do ++p; while (p != end and not (*p == '\"' and isspace(*(p + 1))));
+      do ++p; while (p != end and not (*p == '\"' and is_white(*(p + 1))));
       ++p;
       break;
     }
@@ -422,7 +687,7 @@ const char* skip_value(const char* p, const char* end)
       continue;
     }
 
-    while (p != end and not isspace(*p))
+    while (p != end and not is_white(*p))
       ++p;
 
     break;
@@ -5,6 +5,9 @@
 
 #include "mas.h"
 
+#include <boost/utility/string_ref.hpp>
+
+#include <functional>
 #include <iostream>
 #include <vector>
 
@@ -22,24 +25,39 @@ struct field
 
   std::string value() const
   {
-    std::string result;
-
-    if (m_data[0] == '\'' and m_data_end > m_data and m_data_end[-1] == '\'')
-      result = std::string(m_data + 1, m_data_end - 1);
-    else if (m_data[0] == '"' and
-             m_data_end > m_data and
-             m_data_end[-1] == '"')
-      result = std::string(m_data + 1, m_data_end - 1);
-    else if (m_data[0] == ';' and
-             m_data_end > m_data and
-             m_data_end[-1] == ';')
-      result = std::string(m_data + 1, m_data_end - 1);
-    else
-      result = std::string(m_data, m_data_end);
+    return text().to_string();
+  }
+
+  // the value without its quotes, pointing into the buffer of the file
+  boost::string_ref text() const
+  {
+    boost::string_ref result(m_data, m_data_end - m_data);
+
+    if (m_data_end > m_data and
+        ((m_data[0] == '\'' and m_data_end[-1] == '\'') or
+         (m_data[0] == '"' and m_data_end[-1] == '"') or
+         (m_data[0] == ';' and m_data_end[-1] == ';')))
+      result = boost::string_ref(m_data + 1, m_data_end - m_data - 2);
 
     return result;
   }
 
+  // unknown ('?'), inapplicable ('.') or missing altogether
+  bool is_null() const
+  {
+    boost::string_ref t = text();
+    return t.empty() or t == "?" or t == ".";
+  }
+
+  int64 as_int() const;
+
+  // the first character of the value, 0 if it is empty
+  char as_char() const
+  {
+    boost::string_ref t = text();
+    return t.empty() ? 0 : t[0];
+  }
+
   const char*    m_name;
   const char*    m_name_end;
   const char*    m_data;
@@ -50,6 +68,9 @@ struct row
 {
   std::string operator[](const char* inName) const;
 
+  // the field in a column found by record::column, an empty field for -1
+  const field& column(int32 inColumn) const;
+
   bool operator==(const row& rhs) const
   {
     return m_data == rhs.m_data and m_field == rhs.m_field;
@@ -131,6 +152,10 @@ struct record
 
   void advance(row& row) const;  // update pointers to next data row, if any
 
+  // the column of field inName in the rows, -1 if there is no such field.
+  // Looking up the columns once is a lot faster than row::operator[].
+  int32 column(const char* inName) const;
+
   bool operator<(const record& rhs) const
   {
     return m_name < rhs.m_name;
@@ -151,12 +176,24 @@ class file
   public:
   file(std::istream& is);
 
+  // Reads only the categories in inCategories. The rows of the loop
+  // inStreamed are not kept, they are passed to inRows in batches while the
+  // stream is read, each time inBatchSize bytes of rows were collected. A
+  // batch is only valid during the call.
+  file(std::istream& is, const std::vector<std::string>& inCategories,
+       const std::string& inStreamed,
+       const std::function<void(const record&)>& inRows,
+       size_t inBatchSize = 1024 * 1024);
+
   record operator[](const char* inName) const;
 
   std::string get(const char* inName) const;
   std::string get_joined(const char* inName, const char* inDelimiter) const;
 
   private:
+  // find the records in m_buffer
+  void parse();
+
   std::vector<char>  m_buffer;
   std::vector<record>  m_records;
   const char*      m_data;
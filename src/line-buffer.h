@@ -0,0 +1,153 @@
+// Copyright Maarten L. Hekkelman, Radboud University 2008-2011.
+// Copyright Coos Baakman, Jon Black, Wouter G. Touw & Gert Vriend, Radboud university medical center 2015.
+//   Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE_1_0.txt or copy at
+//             http://www.boost.org/LICENSE_1_0.txt)
+//
+// MLineBuffer collects one line of fixed width columns at a time. It replaces
+// boost::format in the hot loops of the Stockholm and HSSP writers and
+// produces exactly the same text as the format strings it replaces.
+
+#pragma once
+
+#include "mas.h"
+#include "utils.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+class MLineBuffer
+{
+  public:
+                MLineBuffer(size_t inCapacity = 256)
+                {
+                  m_line.reserve(inCapacity);
+                }
+
+  MLineBuffer&  Append(const std::string& inText)
+                {
+                  m_line.append(inText);
+                  return *this;
+                }
+
+  MLineBuffer&  Append(const char* inText)
+                {
+                  m_line.append(inText);
+                  return *this;
+                }
+
+  MLineBuffer&  Append(const char* inText, size_t inLength)
+                {
+                  m_line.append(inText, inLength);
+                  return *this;
+                }
+
+  MLineBuffer&  Append(char inChar, size_t inCount = 1)
+                {
+                  m_line.append(inCount, inChar);
+                  return *this;
+                }
+
+  // Same as %W.Ws: truncate to inWidth characters, then right align
+  MLineBuffer&  Right(const char* inText, size_t inLength, uint32 inWidth)
+                {
+                  if (inLength > inWidth)
+                    inLength = inWidth;
+                  m_line.append(inWidth - inLength, ' ');
+                  m_line.append(inText, inLength);
+                  return *this;
+                }
+
+  MLineBuffer&  Right(const std::string& inText, uint32 inWidth)
+                {
+                  return Right(inText.c_str(), inText.length(), inWidth);
+                }
+
+  // Same as %Wd (and boost's %W.Wd): right aligned, never truncated
+  MLineBuffer&  Right(int64 inValue, uint32 inWidth)
+                {
+                  char digits[24];
+                  size_t n = ToString(inValue, digits);
+                  if (n < inWidth)
+                    m_line.append(inWidth - n, ' ');
+                  m_line.append(digits + sizeof(digits) - n, n);
+                  return *this;
+                }
+
+  // Right aligned, or filled with "--->" when the text does not fit
+  MLineBuffer&  Clipped(const char* inText, size_t inLength, uint32 inWidth)
+                {
+                  if (inLength <= inWidth)
+                  {
+                    m_line.append(inWidth - inLength, ' ');
+                    m_line.append(inText, inLength);
+                  }
+                  else if (inWidth > 0)
+                  {
+                    m_line.append(inWidth - 1, '-');
+                    m_line += '>';
+                  }
+                  return *this;
+                }
+
+  MLineBuffer&  Clipped(const std::string& inText, uint32 inWidth)
+                {
+                  return Clipped(inText.c_str(), inText.length(), inWidth);
+                }
+
+  MLineBuffer&  Clipped(int64 inValue, uint32 inWidth)
+                {
+                  char digits[24];
+                  size_t n = ToString(inValue, digits);
+                  return Clipped(digits + sizeof(digits) - n, n, inWidth);
+                }
+
+  // Same as %W.Pf. The digits come from snprintf, which is the only way to
+  // get the exact rounding of the stream formatting back.
+  MLineBuffer&  Fixed(double inValue, uint32 inWidth, uint32 inPrecision)
+                {
+                  char s[64];
+                  int n = snprintf(s, sizeof(s), "%*.*f", inWidth, inPrecision, inValue);
+                  if (n < 0 or n >= int(sizeof(s)))
+                    throw mas_exception("floating point value does not fit in a column");
+                  m_line.append(s, n);
+                  return *this;
+                }
+
+  const std::string&
+                str() const              { return m_line; }
+  void          clear()                  { m_line.clear(); }
+
+  // Write the line plus a newline and start a new one
+  void          Write(std::ostream& os)
+                {
+                  m_line += '\n';
+                  os.write(m_line.data(), m_line.length());
+                  m_line.clear();
+                }
+
+  private:
+                MLineBuffer(const MLineBuffer&);
+  MLineBuffer&  operator=(const MLineBuffer&);
+
+  // writes the decimal digits at the end of outDigits, returns the count
+  template<size_t N>
+  static size_t ToString(int64 inValue, char (&outDigits)[N])
+                {
+                  uint64 v = inValue < 0 ? 0 - uint64(inValue) : uint64(inValue);
+                  char* p = outDigits + N;
+                  do
+                  {
+                    *--p = char('0' + v % 10);
+                    v /= 10;
+                  }
+                  while (v != 0);
+                  if (inValue < 0)
+                    *--p = '-';
+                  return outDigits + N - p;
+                }
+
+  std::string   m_line;
+};
@@ -8,9 +8,11 @@
 #include "config.h"
 #endif
 
+#include "block-compressor.h"
 #include "fasta.h"
 #include "hssp-nt.h"
 #include "mas.h"
+#include "scheduler.h"
 #include "structure.h"
 #include "utils.h"
 
@@ -77,6 +79,10 @@ int main(int argc, char* argv[])
       ("gap-extend,E", po::value<float>(), "Gap extension penalty (default is 2.0)")
       ("threshold", po::value<float>(), "Homology threshold adjustment (default = 0.05)")
       ("max-hits,m", po::value<uint32>(), "Maximum number of hits to include (default = 5000)")
+      ("align-window", po::value<uint32>(), "Number of hits aligned in parallel before they are added to the profile in order (default is twice the number of threads, 1 aligns one by one)")
+      ("align-staleness", po::value<uint32>(), "Number of profile updates a hit aligned in parallel may miss (default = 0, same result as aligning one by one)")
+      ("distance-band", po::value<uint32>(), "Calculate hit distances only within this many diagonals around the BLAST alignment (default = 0, use the full matrix)")
+      ("seed", po::value<uint32>(), "Seed for the random choice of hits when there are too many (default = 0)")
 #ifdef HAVE_LIBZEEP
       ("fetch-dbrefs", "Fetch DBREF records for each UniProt ID")
 #endif
@@ -179,6 +185,30 @@ int main(int argc, char* argv[])
     if (threads < 1)
       threads = 1;
 
+    // all parallel work, including compressing the output, runs on this
+    // one set of threads
+    MScheduler scheduler(threads);
+
+    uint32 alignWindow = 2 * threads;
+    if (vm.count("align-window"))
+      alignWindow = vm["align-window"].as<uint32>();
+
+    uint32 alignStaleness = 0;
+    if (vm.count("align-staleness"))
+      alignStaleness = vm["align-staleness"].as<uint32>();
+
+    uint32 distanceBand = 0;
+    if (vm.count("distance-band"))
+      distanceBand = vm["distance-band"].as<uint32>();
+
+    // a seed also makes the final random choice of hits depend on it
+    uint32 seed = 0;
+    if (vm.count("seed"))
+    {
+      seed = vm["seed"].as<uint32>();
+      srand(seed);
+    }
+
     // what input to use
     std::string input = vm["input"].as<std::string>();
     io::filtering_stream<io::input> in;
@@ -215,16 +245,13 @@ int main(int argc, char* argv[])
       if (not outfile.is_open())
         throw std::runtime_error("could not create output file");
 
-#ifdef HAVE_LIBBZ2
-      if (ba::ends_with(outfilename.string(), ".bz2"))
-        out.push(io::bzip2_compressor());
-#endif
-#ifdef HAVE_LIBZ
-      if (ba::ends_with(outfilename.string(), ".gz"))
-        out.push(io::gzip_compressor());
-#endif
-
-      out.push(outfile);
+      // compressed output is written as independent blocks, compressed
+      // in parallel
+      MCompression compression = CompressionForFile(outfilename.string());
+      if (compression != eCompressNone)
+        out.push(MBlockCompressor(outfile, compression, scheduler));
+      else
+        out.push(outfile);
     }
     else
       out.push(std::cout);
@@ -238,7 +265,8 @@ int main(int argc, char* argv[])
         try
         {
           HSSP::CreateHSSP(*p, databanks, maxhits, minlength, gapOpen,
-                           gapExtend, threshold, fragmentCutOff, threads,
+                           gapExtend, threshold, fragmentCutOff, scheduler,
+                           alignWindow, alignStaleness, distanceBand, seed,
                            fetchDbRefs, out);
         }
         catch (const std::exception& e)
@@ -260,11 +288,12 @@ int main(int argc, char* argv[])
       else
         a.ReadPDB(in);
 
-      a.CalculateSecondaryStructure();
+      a.CalculateSecondaryStructure(scheduler);
 
       // create the HSSP file
       HSSP::CreateHSSP(a, databanks, maxhits, minlength,
-        gapOpen, gapExtend, threshold, fragmentCutOff, threads, fetchDbRefs, out);
+        gapOpen, gapExtend, threshold, fragmentCutOff, scheduler, alignWindow,
+        alignStaleness, distanceBand, seed, fetchDbRefs, out);
     }
   }
   catch (const std::exception& e)
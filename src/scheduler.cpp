@@ -0,0 +1,168 @@
+// Copyright Maarten L. Hekkelman, Radboud University 2008-2011.
+// Copyright Coos Baakman, Jon Black, Wouter G. Touw & Gert Vriend, Radboud university medical center 2015.
+//   Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE_1_0.txt or copy at
+//             http://www.boost.org/LICENSE_1_0.txt)
+
+#include "scheduler.h"
+
+#include <boost/thread.hpp>
+#include <boost/thread/condition.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <exception>
+
+// --------------------------------------------------------------------
+// A call to Run adds a group of tasks to the list of active groups. Pool
+// threads take the next task from the first group that has one left, the
+// thread that called Run only takes tasks from its own group. That way a
+// waiting thread never gets stuck in unrelated work, and nested calls
+// always make progress.
+
+struct MTaskGroup
+{
+  MTaskGroup(uint32 inCount, const std::function<void(uint32)>& inTask)
+    : m_task(inTask), m_count(inCount), m_next(0), m_finished(0) {}
+
+  const std::function<void(uint32)>& m_task;
+  uint32 m_count, m_next, m_finished;
+  std::exception_ptr m_error;
+};
+
+struct MScheduler::MSchedulerImpl
+{
+                MSchedulerImpl() : m_stop(false) {}
+
+  void          Work();
+  // run task inNr of ioGroup, called with m_mutex locked
+  void          Execute(MTaskGroup& ioGroup, uint32 inNr,
+                        boost::mutex::scoped_lock& inLock);
+
+  boost::mutex  m_mutex;
+  boost::condition
+                m_work, m_done;
+  std::deque<MTaskGroup*>
+                m_groups;
+  std::deque<std::function<void()>>
+                m_posted;
+  bool          m_stop;
+  boost::thread_group
+                m_threads;
+};
+
+void MScheduler::MSchedulerImpl::Execute(MTaskGroup& ioGroup, uint32 inNr,
+                                         boost::mutex::scoped_lock& inLock)
+{
+  if (ioGroup.m_next == ioGroup.m_count)
+  {
+    auto i = std::find(m_groups.begin(), m_groups.end(), &ioGroup);
+    if (i != m_groups.end())
+      m_groups.erase(i);
+  }
+
+  inLock.unlock();
+
+  std::exception_ptr error;
+  try
+  {
+    ioGroup.m_task(inNr);
+  }
+  catch (...)
+  {
+    error = std::current_exception();
+  }
+
+  inLock.lock();
+
+  if (error and not ioGroup.m_error)
+    ioGroup.m_error = error;
+
+  if (++ioGroup.m_finished == ioGroup.m_count)
+    m_done.notify_all();
+}
+
+void MScheduler::MSchedulerImpl::Work()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  for (;;)
+  {
+    while (not m_stop and m_groups.empty() and m_posted.empty())
+      m_work.wait(lock);
+
+    if (not m_groups.empty())
+    {
+      MTaskGroup* group = m_groups.front();
+      Execute(*group, group->m_next++, lock);
+    }
+    else if (not m_posted.empty())
+    {
+      std::function<void()> task;
+      task.swap(m_posted.front());
+      m_posted.pop_front();
+
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+    else
+      break;
+  }
+}
+
+// --------------------------------------------------------------------
+
+MScheduler::MScheduler(uint32 inThreads)
+  : m_size(inThreads > 1 ? inThreads : 1)
+  , m_impl(new MSchedulerImpl)
+{
+  for (uint32 t = 1; t < m_size; ++t)
+    m_impl->m_threads.create_thread([this]() { m_impl->Work(); });
+}
+
+MScheduler::~MScheduler()
+{
+  {
+    boost::mutex::scoped_lock lock(m_impl->m_mutex);
+    m_impl->m_stop = true;
+    m_impl->m_work.notify_all();
+  }
+
+  m_impl->m_threads.join_all();
+  delete m_impl;
+}
+
+void MScheduler::Run(uint32 inCount, const std::function<void(uint32)>& inTask)
+{
+  MTaskGroup group(inCount, inTask);
+
+  boost::mutex::scoped_lock lock(m_impl->m_mutex);
+
+  if (inCount > 1 and m_size > 1)
+  {
+    m_impl->m_groups.push_back(&group);
+    m_impl->m_work.notify_all();
+  }
+
+  while (group.m_next < group.m_count)
+    m_impl->Execute(group, group.m_next++, lock);
+
+  while (group.m_finished < group.m_count)
+    m_impl->m_done.wait(lock);
+
+  if (group.m_error)
+    std::rethrow_exception(group.m_error);
+}
+
+void MScheduler::Post(const std::function<void()>& inTask)
+{
+  if (m_size == 1)
+    inTask();
+  else
+  {
+    boost::mutex::scoped_lock lock(m_impl->m_mutex);
+    m_impl->m_posted.push_back(inTask);
+    m_impl->m_work.notify_one();
+  }
+}
@@ -0,0 +1,46 @@
+// Copyright Maarten L. Hekkelman, Radboud University 2008-2011.
+// Copyright Coos Baakman, Jon Black, Wouter G. Touw & Gert Vriend, Radboud university medical center 2015.
+//   Distributed under the Boost Software License, Version 1.0.
+//       (See accompanying file LICENSE_1_0.txt or copy at
+//             http://www.boost.org/LICENSE_1_0.txt)
+//
+// MScheduler is the one pool of threads a program uses for all its parallel
+// work. It is created in main with the number of threads the user asked
+// for and handed to every phase, which then splits its work into tasks
+// instead of starting threads of its own.
+
+#pragma once
+
+#include "mas.h"
+
+#include <functional>
+
+class MScheduler
+{
+  public:
+                MScheduler(uint32 inThreads);
+                ~MScheduler();
+
+  // the number of threads doing work, the thread calling Run included
+  uint32        Size() const              { return m_size; }
+
+  // Run inTask(0) ... inTask(inCount - 1) and wait until they are done.
+  // Idle pool threads pick up the tasks; the calling thread works on them
+  // as well, so Run may be called from within a task. The first exception
+  // thrown by a task is rethrown once all tasks have finished.
+  void          Run(uint32 inCount, const std::function<void(uint32)>& inTask);
+
+  // Run inTask on a pool thread without waiting for it, or right away when
+  // the pool has no threads of its own. inTask should not throw.
+  void          Post(const std::function<void()>& inTask);
+
+  private:
+                MScheduler(const MScheduler&);
+  MScheduler&   operator=(const MScheduler&);
+
+  struct MSchedulerImpl;
+
+  uint32        m_size;
+  MSchedulerImpl*
+                m_impl;
+};
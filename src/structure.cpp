@@ -9,8 +9,8 @@
 #include "structure.h"
 
 #include "align-2d.h"
-#include "buffer.h"
 #include "iocif.h"
+#include "scheduler.h"
 #include "utils.h"
 
 #include <boost/algorithm/string.hpp>
@@ -18,18 +18,21 @@
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
-#include <boost/math/special_functions/round.hpp>
-#include <boost/optional.hpp>
+#include <boost/thread.hpp>
 
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <set>
+#include <unordered_map>
 #include <numeric>
 #include <functional>
 
-namespace ba = boost::algorithm;
-namespace bm = boost::math;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-using boost::none;
-using boost::optional;
+namespace ba = boost::algorithm;
 
 #define foreach BOOST_FOREACH
 // --------------------------------------------------------------------
@@ -55,6 +58,13 @@ const double
 namespace
 {
 
+// the candidate atoms are tested against a surface dot this many at a time
+const uint32 kCandidateBlock = 4;
+
+// and the H-bond energies of a donor are calculated for this many acceptors,
+// as many as fit in one SSE2 register
+const uint32 kAcceptorBlock = 2;
+
 // we use a fibonacci spheres to calculate the even distribution of the dots
 class MSurfaceDots
 {
@@ -65,10 +75,16 @@ class MSurfaceDots
   const MPoint& operator[](uint32 inIx) const  { return mPoints[inIx]; }
   double weight() const { return mWeight; }
 
+  // the coordinates as floats, one array per axis
+  const float* x() const { return &mX[0]; }
+  const float* y() const { return &mY[0]; }
+  const float* z() const { return &mZ[0]; }
+
   private:
     MSurfaceDots(int32 inN);
 
   std::vector<MPoint> mPoints;
+  std::vector<float> mX, mY, mZ;
   double mWeight;
 };
 
@@ -100,16 +116,250 @@ MSurfaceDots::MSurfaceDots(int32 N)
 
     mPoints.push_back(p);
   }
+
+  // Neighbouring dots are mostly buried by the same atoms, testing them
+  // one after the other makes the tests predictable. Order the dots on
+  // longitude within a few bands of latitude. All dots carry the same
+  // weight, the order does not change the surface.
+  const double kBands = 8;
+  auto key = [kBands](const MPoint& p) {
+    return std::make_tuple(floor((asin(p.mZ) / kPI + 0.5) * kBands),
+                           atan2(p.mY, p.mX));
+  };
+  std::stable_sort(mPoints.begin(), mPoints.end(),
+    [&key](const MPoint& a, const MPoint& b) { return key(a) < key(b); });
+
+  foreach (const MPoint& p, mPoints)
+  {
+    mX.push_back(static_cast<float>(p.mX));
+    mY.push_back(static_cast<float>(p.mY));
+    mZ.push_back(static_cast<float>(p.mZ));
+  }
+}
+
+}
+
+// --------------------------------------------------------------------
+// A uniform grid of cells over the residue centers, used to find the
+// residues near some point without looking at all of them. The residue
+// indices are stored per cell, cell after cell.
+
+class MResidueGrid
+{
+  public:
+            MResidueGrid(const std::vector<MResidue*>& inResidues);
+
+  // indices of the residues with their center within inDistance of
+  // inPoint, in increasing order
+  void        Near(const MPoint& inPoint, double inDistance,
+                   std::vector<uint32>& outResidues) const;
+
+  // the largest radius of a residue and the largest distance of a
+  // C-alpha to the center of its residue
+  double        MaxRadius() const        { return mMaxRadius; }
+  double        MaxCAlphaOffset() const      { return mMaxCAlphaOffset; }
+
+  private:
+
+  int32        CellIndex(double inCoordinate, double inOrigin,
+                          int32 inSize) const;
+
+  std::vector<MPoint>  mCenters;
+  std::vector<uint32>  mCellStart, mResidues;
+  MPoint        mOrigin;
+  double        mCellSize, mMaxRadius, mMaxCAlphaOffset;
+  int32        mSize[3];
+};
+
+MResidueGrid::MResidueGrid(const std::vector<MResidue*>& inResidues)
+  : mCellSize(kMinimalCADistance), mMaxRadius(0), mMaxCAlphaOffset(0)
+{
+  mSize[0] = mSize[1] = mSize[2] = 1;
+
+  if (inResidues.empty())
+  {
+    mCellStart.assign(2, 0);
+    return;
+  }
+
+  MPoint max;
+  mOrigin.mX = mOrigin.mY = mOrigin.mZ = std::numeric_limits<double>::max();
+  max.mX = max.mY = max.mZ = -std::numeric_limits<double>::max();
+
+  mCenters.reserve(inResidues.size());
+  foreach (const MResidue* r, inResidues)
+  {
+    MPoint center;
+    double radius;
+    r->GetCenterAndRadius(center, radius);
+    mCenters.push_back(center);
+
+    mMaxRadius = std::max(mMaxRadius, radius);
+    mMaxCAlphaOffset = std::max(mMaxCAlphaOffset,
+                                Distance(r->GetCAlpha(), center));
+
+    mOrigin.mX = std::min(mOrigin.mX, center.mX);
+    mOrigin.mY = std::min(mOrigin.mY, center.mY);
+    mOrigin.mZ = std::min(mOrigin.mZ, center.mZ);
+    max.mX = std::max(max.mX, center.mX);
+    max.mY = std::max(max.mY, center.mY);
+    max.mZ = std::max(max.mZ, center.mZ);
+  }
+
+  // residue neighbours for the accessibility are at most two radii
+  // apart, cells of one radius keep those queries small. Very sparse
+  // structures get larger cells to limit the number of empty ones.
+  mCellSize = std::max(mCellSize, mMaxRadius);
+
+  const int64 kMaxCells = 8 * static_cast<int64>(inResidues.size()) + 64;
+  for (;;)
+  {
+    mSize[0] = static_cast<int32>((max.mX - mOrigin.mX) / mCellSize) + 1;
+    mSize[1] = static_cast<int32>((max.mY - mOrigin.mY) / mCellSize) + 1;
+    mSize[2] = static_cast<int32>((max.mZ - mOrigin.mZ) / mCellSize) + 1;
+
+    if (static_cast<int64>(mSize[0]) * mSize[1] * mSize[2] <= kMaxCells)
+      break;
+
+    mCellSize *= 2;
+  }
+
+  // a counting sort of the residues on their cell
+  std::vector<uint32> cell(mCenters.size());
+  mCellStart.assign(mSize[0] * mSize[1] * mSize[2] + 1, 0);
+
+  for (uint32 i = 0; i < mCenters.size(); ++i)
+  {
+    cell[i] = (CellIndex(mCenters[i].mZ, mOrigin.mZ, mSize[2]) * mSize[1] +
+               CellIndex(mCenters[i].mY, mOrigin.mY, mSize[1])) * mSize[0] +
+              CellIndex(mCenters[i].mX, mOrigin.mX, mSize[0]);
+    ++mCellStart[cell[i] + 1];
+  }
+
+  for (uint32 c = 1; c < mCellStart.size(); ++c)
+    mCellStart[c] += mCellStart[c - 1];
+
+  std::vector<uint32> next(mCellStart.begin(), mCellStart.end() - 1);
+  mResidues.resize(mCenters.size());
+  for (uint32 i = 0; i < mCenters.size(); ++i)
+    mResidues[next[cell[i]]++] = i;
+}
+
+inline
+int32 MResidueGrid::CellIndex(double inCoordinate, double inOrigin,
+                              int32 inSize) const
+{
+  double c = floor((inCoordinate - inOrigin) / mCellSize);
+  return c < 0 ? 0 : (c >= inSize ? inSize - 1 : static_cast<int32>(c));
+}
+
+void MResidueGrid::Near(const MPoint& inPoint, double inDistance,
+                        std::vector<uint32>& outResidues) const
+{
+  outResidues.clear();
+
+  int32 x0 = CellIndex(inPoint.mX - inDistance, mOrigin.mX, mSize[0]),
+        x1 = CellIndex(inPoint.mX + inDistance, mOrigin.mX, mSize[0]),
+        y0 = CellIndex(inPoint.mY - inDistance, mOrigin.mY, mSize[1]),
+        y1 = CellIndex(inPoint.mY + inDistance, mOrigin.mY, mSize[1]),
+        z0 = CellIndex(inPoint.mZ - inDistance, mOrigin.mZ, mSize[2]),
+        z1 = CellIndex(inPoint.mZ + inDistance, mOrigin.mZ, mSize[2]);
+
+  double d2 = inDistance * inDistance;
+
+  for (int32 z = z0; z <= z1; ++z)
+  {
+    for (int32 y = y0; y <= y1; ++y)
+    {
+      int32 c = (z * mSize[1] + y) * mSize[0];
+      for (uint32 k = mCellStart[c + x0]; k < mCellStart[c + x1 + 1]; ++k)
+      {
+        uint32 i = mResidues[k];
+        if (DistanceSquared(mCenters[i], inPoint) <= d2)
+          outResidues.push_back(i);
+      }
+    }
+  }
+
+  std::sort(outResidues.begin(), outResidues.end());
+}
+
+// --------------------------------------------------------------------
+// The pool keeps its strings in blocks that are never moved or freed, so
+// Get needs no lock. A string number is only handed out after its string
+// was stored.
+
+namespace
+{
+
+const uint32
+  kStringBlockSize = 4096,
+  kMaxStringBlocks = 4096;
+
+struct MStringPoolImpl
+{
+  MStringPoolImpl() : mCount(1) {}
+
+  boost::mutex mMutex;
+  std::unordered_map<std::string, uint32> mIDs;
+  std::string* mBlocks[kMaxStringBlocks] = {};
+  uint32 mCount;
+};
+
+MStringPoolImpl& StringPool()
+{
+  static MStringPoolImpl sPool;
+  return sPool;
+}
+
+}
+
+uint32 MStringPool::Intern(const std::string& inString)
+{
+  if (inString.empty())
+    return 0;
+
+  MStringPoolImpl& pool = StringPool();
+  boost::mutex::scoped_lock lock(pool.mMutex);
+
+  auto i = pool.mIDs.find(inString);
+  if (i != pool.mIDs.end())
+    return i->second;
+
+  uint32 result = pool.mCount;
+  if (result / kStringBlockSize >= kMaxStringBlocks)
+    throw mas_exception("too many distinct strings in atom records");
+
+  std::string*& block = pool.mBlocks[result / kStringBlockSize];
+  if (block == nullptr)
+    block = new std::string[kStringBlockSize];
+  block[result % kStringBlockSize] = inString;
+
+  pool.mIDs[inString] = result;
+  ++pool.mCount;
+
+  return result;
 }
 
+const std::string& MStringPool::Get(uint32 inID)
+{
+  static const std::string kEmpty;
+
+  if (inID == 0)
+    return kEmpty;
+  return StringPool().mBlocks[inID / kStringBlockSize][inID % kStringBlockSize];
 }
 
 // --------------------------------------------------------------------
 
 MAtomType MapElement(std::string inElement)
 {
-  ba::trim(inElement);
-  ba::to_upper(inElement);
+  // called for every atom, so without the locales of ba::trim and ba::to_upper
+  std::string::size_type b = inElement.find_first_not_of(" \t\n\v\f\r"),
+                         e = inElement.find_last_not_of(" \t\n\v\f\r");
+  inElement = b == std::string::npos ? std::string() : inElement.substr(b, e + 1 - b);
+  for (char& ch: inElement)
+    ch = toupper(ch);
 
   MAtomType result = kUnknownAtom;
   if (inElement == "H")
@@ -180,7 +430,7 @@ MResidueType MapResidue(char inCode)
 // --------------------------------------------------------------------
 // a custom float parser, optimised for speed (and the way floats are represented in a PDB file)
 
-double ParseFloat(const std::string& s)
+double ParseFloat(const char* inBegin, const char* inEnd)
 {
   double result = 0;
   bool negate = false;
@@ -190,7 +440,7 @@ double ParseFloat(const std::string& s)
     pStart, pSign, pFirst, pSecond
   } state = pStart;
 
-  for (std::string::const_iterator ch = s.begin(); ch != s.end(); ++ch)
+  for (const char* ch = inBegin; ch != inEnd; ++ch)
   {
     switch (state)
     {
@@ -212,7 +462,7 @@ double ParseFloat(const std::string& s)
           state = pFirst;
         }
         else
-          throw mas_exception(boost::format("invalid formatted floating point number '%1%'") % s);
+          throw mas_exception(boost::format("invalid formatted floating point number '%1%'") % std::string(inBegin, inEnd));
         break;
 
       case pSign:
@@ -224,7 +474,7 @@ double ParseFloat(const std::string& s)
           result = *ch - '0';
         }
         else
-          throw mas_exception(boost::format("invalid formatted floating point number '%1%'") % s);
+          throw mas_exception(boost::format("invalid formatted floating point number '%1%'") % std::string(inBegin, inEnd));
         break;
 
       case pFirst:
@@ -233,7 +483,7 @@ double ParseFloat(const std::string& s)
         else if (isdigit(*ch))
           result = 10 * result + (*ch - '0');
         else
-          throw mas_exception(boost::format("invalid formatted floating point number '%1%'") % s);
+          throw mas_exception(boost::format("invalid formatted floating point number '%1%'") % std::string(inBegin, inEnd));
         break;
 
       case pSecond:
@@ -243,7 +493,7 @@ double ParseFloat(const std::string& s)
           div *= 10;
         }
         else
-          throw mas_exception(boost::format("invalid formatted floating point number '%1%'") % s);
+          throw mas_exception(boost::format("invalid formatted floating point number '%1%'") % std::string(inBegin, inEnd));
         break;
     }
   }
@@ -254,6 +504,43 @@ double ParseFloat(const std::string& s)
   return result;
 }
 
+double ParseFloat(const std::string& s)
+{
+  return ParseFloat(s.data(), s.data() + s.length());
+}
+
+double ParseFloat(const boost::string_ref& s)
+{
+  return ParseFloat(s.begin(), s.end());
+}
+
+// integers in fixed columns, padded with spaces
+int64 ParseInteger(const char* inBegin, const char* inEnd)
+{
+  while (inBegin != inEnd and isspace(*inBegin))
+    ++inBegin;
+  while (inEnd != inBegin and isspace(inEnd[-1]))
+    --inEnd;
+
+  const char* ch = inBegin;
+  bool negate = false;
+  if (ch != inEnd and (*ch == '-' or *ch == '+'))
+    negate = *ch++ == '-';
+
+  if (ch == inEnd)
+    throw mas_exception(boost::format("invalid formatted integer '%1%'") % std::string(inBegin, inEnd));
+
+  int64 result = 0;
+  for (; ch != inEnd; ++ch)
+  {
+    if (not isdigit(*ch))
+      throw mas_exception(boost::format("invalid formatted integer '%1%'") % std::string(inBegin, inEnd));
+    result = 10 * result + (*ch - '0');
+  }
+
+  return negate ? -result : result;
+}
+
 void MAtom::WritePDB(std::ostream& os) const
 {
   //  1 - 6  Record name "ATOM "
@@ -283,8 +570,8 @@ void MAtom::WritePDB(std::ostream& os) const
       charge += '-';
   }
 
-  os << (atom % mSerial % mName % mAltLoc % mResName % mChainID % mResSeq % mICode %
-       mLoc.mX % mLoc.mY % mLoc.mZ % mOccupancy % mTempFactor % mElement % charge) << std::endl;
+  os << (atom % mSerial % GetName() % mAltLoc % GetResName() % GetChainID() % mResSeq % GetICode() %
+       mLoc.mX % mLoc.mY % mLoc.mZ % mOccupancy % mTempFactor % GetElement() % charge) << std::endl;
 }
 
 const MResidueInfo kResidueInfo[] = {
@@ -315,7 +602,6 @@ struct MBridge
 {
   MBridgeType type;
   uint32 sheet, ladder;
-  std::set<MBridge*> link;
   std::deque<uint32> i, j;
   std::string chainI, chainJ;
 
@@ -331,27 +617,93 @@ std::ostream& operator<<(std::ostream& os, const MBridge& b)
   return os;
 }
 
-// return true if any of the residues in bridge a is identical to any of the
-// residues in bridge b
-bool Linked(const MBridge& a, const MBridge& b)
+// A disjoint-set forest over the ladders. The root of a set is always its
+// lowest numbered member.
+class MLadderSets
 {
-  return
-    find_first_of(a.i.begin(), a.i.end(), b.i.begin(), b.i.end()) != a.i.end() or
-    find_first_of(a.i.begin(), a.i.end(), b.j.begin(), b.j.end()) != a.i.end() or
-    find_first_of(a.j.begin(), a.j.end(), b.i.begin(), b.i.end()) != a.j.end() or
-    find_first_of(a.j.begin(), a.j.end(), b.j.begin(), b.j.end()) != a.j.end();
+  public:
+            MLadderSets(uint32 inCount)
+              : mParent(inCount)
+            {
+              std::iota(mParent.begin(), mParent.end(), 0);
+            }
+
+  uint32    Root(uint32 inLadder)
+            {
+              while (mParent[inLadder] != inLadder)
+              {
+                mParent[inLadder] = mParent[mParent[inLadder]];
+                inLadder = mParent[inLadder];
+              }
+              return inLadder;
+            }
+
+  void      Join(uint32 inA, uint32 inB)
+            {
+              inA = Root(inA);
+              inB = Root(inB);
+              if (inA < inB)
+                mParent[inB] = inA;
+              else
+                mParent[inA] = inB;
+            }
+
+  private:
+  std::vector<uint32>  mParent;
+};
+
+// --------------------------------------------------------------------
+
+MArena::MArena(MArena&& inArena)
+  : mBlocks(std::move(inArena.mBlocks)), mFree(inArena.mFree)
+  , mLeft(inArena.mLeft)
+{
+  inArena.mBlocks.clear();
+  inArena.mFree = nullptr;
+  inArena.mLeft = 0;
+}
+
+MArena::~MArena()
+{
+  foreach (char* block, mBlocks)
+    delete[] block;
+}
+
+void* MArena::Allocate(size_t inSize)
+{
+  const size_t kAlignment = alignof(std::max_align_t), kBlockSize = 256 * 1024;
+
+  inSize = (inSize + kAlignment - 1) & ~(kAlignment - 1);
+  if (inSize > mLeft)
+  {
+    // large requests get a block of their own
+    if (inSize > kBlockSize / 4)
+    {
+      mBlocks.push_back(new char[inSize]);
+      return mBlocks.back();
+    }
+
+    mBlocks.push_back(new char[kBlockSize]);
+    mFree = mBlocks.back();
+    mLeft = kBlockSize;
+  }
+
+  void* result = mFree;
+  mFree += inSize;
+  mLeft -= inSize;
+  return result;
 }
 
 // --------------------------------------------------------------------
 
 MResidue::MResidue(int32 inNumber, MResidue* inPrevious,
-                   const std::vector<MAtom>& inAtoms)
+                   const std::vector<MAtom>& inAtoms, MArena& ioArena)
   : mPrev(inPrevious)
   , mNext(nullptr)
   , mSeqNumber(inAtoms.front().mResSeq)
   , mNumber(inNumber)
-  , mInsertionCode(inAtoms.front().mICode)
-  , mType(MapResidue(inAtoms.front().mResName))
+  , mInsertionCode(inAtoms.front().GetICode())
+  , mType(MapResidue(inAtoms.front().GetResName()))
   , mSSBridgeNr(0)
   , mAccessibility(0)
   , mSecondaryStructure(loop)
@@ -371,31 +723,50 @@ MResidue::MResidue(int32 inNumber, MResidue* inPrevious,
   static const MAtom kNullAtom = {};
   mN = mCA = mC = mO = kNullAtom;
 
+  static const uint32
+    kN = MStringPool::Intern("N"), kCA = MStringPool::Intern("CA"),
+    kC = MStringPool::Intern("C"), kO = MStringPool::Intern("O");
+
+  uint32 sideChainSize = 0;
+  foreach (const MAtom& atom, inAtoms)
+  {
+    if (atom.mName != kN and atom.mName != kCA and atom.mName != kC and
+        atom.mName != kO)
+      ++sideChainSize;
+  }
+
+  MAtom* sideChain = static_cast<MAtom*>(
+    ioArena.Allocate(sideChainSize * sizeof(MAtom)));
+  MAtom* sideChainEnd = sideChain;
+
   foreach (const MAtom& atom, inAtoms)
   {
     if (mChainID.empty())
-      mChainID = atom.mChainID;
+      mChainID = atom.GetChainID();
 
-    if (MapResidue(atom.mResName) != mType)
+    if (atom.mResName != inAtoms.front().mResName and
+        MapResidue(atom.GetResName()) != mType)
       throw mas_exception(
         boost::format("inconsistent residue types in atom records for residue %1% (%2% != %3%)")
-          % atom.mResSeq % atom.mResName % inAtoms.front().mResName);
+          % atom.mResSeq % atom.GetResName() % inAtoms.front().GetResName());
 
     if (atom.mResSeq != mSeqNumber)
       throw mas_exception(boost::format("inconsistent residue sequence numbers (%1% != %2%)") % atom.mResSeq % mSeqNumber);
 
-    if (atom.GetName() == "N")
+    if (atom.mName == kN)
       mN = atom;
-    else if (atom.GetName() == "CA")
+    else if (atom.mName == kCA)
       mCA = atom;
-    else if (atom.GetName() == "C")
+    else if (atom.mName == kC)
       mC = atom;
-    else if (atom.GetName() == "O")
+    else if (atom.mName == kO)
       mO = atom;
     else
-      mSideChain.push_back(atom);
+      new (sideChainEnd++) MAtom(atom);
   }
 
+  mSideChain = MSideChain(sideChain, sideChainEnd);
+
   // assign the Hydrogen
   mH = GetN();
 
@@ -433,7 +804,7 @@ MResidue::MResidue(int32 inNumber, MResidue* inPrevious,
   mCenter.mZ = (mBox[0].mZ + mBox[1].mZ) / 2;
 
   if (VERBOSE > 3)
-    std::cerr << "Created residue " << mN.mResName << std::endl;
+    std::cerr << "Created residue " << mN.GetResName() << std::endl;
 }
 
 MResidue::MResidue(int32 inNumber, char inTypeCode, MResidue* inPrevious)
@@ -449,6 +820,7 @@ MResidue::MResidue(int32 inNumber, char inTypeCode, MResidue* inPrevious)
   , mBend(false)
   , mRadius(0)
   , mH(MAtom())
+  , mSideChain(nullptr, nullptr)
 {
   std::fill(mHelixFlags, mHelixFlags + 3, helixNone);
 
@@ -461,35 +833,7 @@ MResidue::MResidue(int32 inNumber, char inTypeCode, MResidue* inPrevious)
   mN = mCA = mC = mO = kNullAtom;
 
   mCA.mResSeq = inTypeCode;
-  mCA.mChainID = "A";
-}
-
-MResidue::MResidue(const MResidue& residue)
-  : mChainID(residue.mChainID)
-  , mPrev(nullptr)
-  , mNext(nullptr)
-  , mSeqNumber(residue.mSeqNumber)
-  , mNumber(residue.mNumber)
-  , mType(residue.mType)
-  , mSSBridgeNr(residue.mSSBridgeNr)
-  , mAccessibility(residue.mAccessibility)
-  , mSecondaryStructure(residue.mSecondaryStructure)
-  , mC(residue.mC)
-  , mN(residue.mN)
-  , mCA(residue.mCA)
-  , mO(residue.mO)
-  , mH(residue.mH)
-  , mSideChain(residue.mSideChain)
-  , mSheet(residue.mSheet)
-  , mBend(residue.mBend)
-  , mCenter(residue.mCenter)
-  , mRadius(residue.mRadius)
-{
-  std::copy(residue.mHBondDonor, residue.mHBondDonor + 2, mHBondDonor);
-  std::copy(residue.mHBondAcceptor, residue.mHBondAcceptor + 2, mHBondAcceptor);
-  std::copy(residue.mBetaPartner, residue.mBetaPartner + 2, mBetaPartner);
-  std::copy(residue.mHelixFlags, residue.mHelixFlags + 3, mHelixFlags);
-  std::copy(residue.mBox, residue.mBox + 2, mBox);
+  mCA.SetChainID("A");
 }
 
 void MResidue::SetPrev(MResidue* inResidue)
@@ -521,7 +865,7 @@ void MResidue::SetChainID(const std::string& inChainID)
   mO.SetChainID(inChainID);
   mN.SetChainID(inChainID);
   mH.SetChainID(inChainID);
-  for_each(mSideChain.begin(), mSideChain.end(),
+  std::for_each(mSideChain.begin(), mSideChain.end(),
            boost::bind(&MAtom::SetChainID, _1, inChainID));
 }
 
@@ -647,8 +991,26 @@ uint8 MResidue::GetSSBridgeNr() const
   return mSSBridgeNr;
 }
 
+// the energy as reported, given the electrostatic energy and the shortest
+// of the four distances it was calculated from
+double ClampHBondEnergy(double inEnergy, double inShortestDistance)
+{
+  double result = inEnergy;
+  if (inShortestDistance < kMinimalDistance)
+    result = kMinHBondEnergy;
+
+  // DSSP compatibility mode, rounds halfway cases away from zero just like
+  // boost::math::round but without its checks:
+  result = std::round(result * 1000) / 1000;
+
+  if (result < kMinHBondEnergy)
+    result = kMinHBondEnergy;
+
+  return result;
+}
+
 // TODO: use the angle to improve bond energy calculation.
-double MResidue::CalculateHBondEnergy(MResidue& inDonor, MResidue& inAcceptor)
+double MResidue::HBondEnergy(const MResidue& inDonor, const MResidue& inAcceptor)
 {
   double result = 0;
 
@@ -659,44 +1021,157 @@ double MResidue::CalculateHBondEnergy(MResidue& inDonor, MResidue& inAcceptor)
     double distanceNC = Distance(inDonor.GetN(), inAcceptor.GetC());
     double distanceNO = Distance(inDonor.GetN(), inAcceptor.GetO());
 
-    if (distanceHO < kMinimalDistance or distanceHC < kMinimalDistance or
-        distanceNC < kMinimalDistance or distanceNO < kMinimalDistance)
-      result = kMinHBondEnergy;
-    else
-      result = kCouplingConstant / distanceHO - kCouplingConstant / distanceHC + kCouplingConstant / distanceNC - kCouplingConstant / distanceNO;
+    result = ClampHBondEnergy(
+      kCouplingConstant / distanceHO - kCouplingConstant / distanceHC + kCouplingConstant / distanceNC - kCouplingConstant / distanceNO,
+      std::min(std::min(distanceHO, distanceHC), std::min(distanceNC, distanceNO)));
+  }
+
+  return result;
+}
+
+// The C and O atoms of the acceptors for one donor, one array per axis.
+// The arrays are padded to a multiple of kAcceptorBlock with atoms far away.
+struct MAcceptorBlocks
+{
+  MAcceptorBlocks() : count(0) {}
+
+  // make room for at most inCount acceptors
+  void reset(uint32 inCount)
+  {
+    uint32 padded = (inCount + kAcceptorBlock - 1) / kAcceptorBlock * kAcceptorBlock;
+    if (residues.size() < padded)
+    {
+      residues.resize(padded);
+      cx.resize(padded); cy.resize(padded); cz.resize(padded);
+      ox.resize(padded); oy.resize(padded); oz.resize(padded);
+    }
+    count = 0;
+  }
 
-    // DSSP compatibility mode:
-    result = bm::round(result * 1000) / 1000;
+  void add(uint32 inIndex, const MResidue& inAcceptor)
+  {
+    const MPoint& c = inAcceptor.GetC();
+    const MPoint& o = inAcceptor.GetO();
 
-    if (result < kMinHBondEnergy)
-      result = kMinHBondEnergy;
+    residues[count] = inIndex;
+    cx[count] = c.mX; cy[count] = c.mY; cz[count] = c.mZ;
+    ox[count] = o.mX; oy[count] = o.mY; oz[count] = o.mZ;
+    ++count;
   }
 
-  // update donor
-  if (result < inDonor.mHBondAcceptor[0].energy)
+  // fill up the last block and return the padded count
+  uint32 pad()
   {
-    inDonor.mHBondAcceptor[1] = inDonor.mHBondAcceptor[0];
-    inDonor.mHBondAcceptor[0].residue = &inAcceptor;
-    inDonor.mHBondAcceptor[0].energy = result;
+    const double kFar = 1e6;
+
+    uint32 padded = count;
+    for (; padded % kAcceptorBlock; ++padded)
+    {
+      cx[padded] = cy[padded] = cz[padded] = kFar;
+      ox[padded] = oy[padded] = oz[padded] = kFar;
+    }
+    return padded;
   }
-  else if (result < inDonor.mHBondAcceptor[1].energy)
+
+  uint32 count;
+  std::vector<uint32> residues;
+  std::vector<double> cx, cy, cz, ox, oy, oz;
+};
+
+#if defined(__SSE2__)
+// the distances from one point to kAcceptorBlock points
+inline __m128d PackedDistance(const MPoint& inA, const double* inX,
+                              const double* inY, const double* inZ)
+{
+  __m128d dx = _mm_sub_pd(_mm_set1_pd(inA.mX), _mm_loadu_pd(inX));
+  __m128d dy = _mm_sub_pd(_mm_set1_pd(inA.mY), _mm_loadu_pd(inY));
+  __m128d dz = _mm_sub_pd(_mm_set1_pd(inA.mZ), _mm_loadu_pd(inZ));
+
+  return _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx),
+    _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz)));
+}
+#endif
+
+// The energies of the bonds from inDonor, not a proline, to all acceptors in
+// inAcceptors. A block of acceptors is done at a time with packed doubles.
+// The arithmetic is the same as in HBondEnergy, operation for operation,
+// and so are the energies.
+void CalculateAcceptorEnergies(const MResidue& inDonor,
+                               MAcceptorBlocks& inAcceptors,
+                               std::vector<double>& outEnergies)
+{
+  uint32 padded = inAcceptors.pad();
+
+  const MPoint& h = inDonor.GetH();
+  const MPoint& n = inDonor.GetN();
+
+  if (outEnergies.size() < padded)
+    outEnergies.resize(padded);
+
+  for (uint32 k = 0; k < padded; k += kAcceptorBlock)
   {
-    inDonor.mHBondAcceptor[1].residue = &inAcceptor;
-    inDonor.mHBondAcceptor[1].energy = result;
+    const double* cx = &inAcceptors.cx[k];
+    const double* cy = &inAcceptors.cy[k];
+    const double* cz = &inAcceptors.cz[k];
+    const double* ox = &inAcceptors.ox[k];
+    const double* oy = &inAcceptors.oy[k];
+    const double* oz = &inAcceptors.oz[k];
+
+    double energy[kAcceptorBlock], shortest[kAcceptorBlock];
+
+#if defined(__SSE2__)
+    __m128d distanceHO = PackedDistance(h, ox, oy, oz);
+    __m128d distanceHC = PackedDistance(h, cx, cy, cz);
+    __m128d distanceNC = PackedDistance(n, cx, cy, cz);
+    __m128d distanceNO = PackedDistance(n, ox, oy, oz);
+
+    __m128d coupling = _mm_set1_pd(kCouplingConstant);
+    _mm_storeu_pd(energy, _mm_sub_pd(_mm_add_pd(_mm_sub_pd(
+      _mm_div_pd(coupling, distanceHO), _mm_div_pd(coupling, distanceHC)),
+      _mm_div_pd(coupling, distanceNC)), _mm_div_pd(coupling, distanceNO)));
+    _mm_storeu_pd(shortest, _mm_min_pd(_mm_min_pd(distanceHO, distanceHC),
+                                       _mm_min_pd(distanceNC, distanceNO)));
+#else
+    for (uint32 l = 0; l < kAcceptorBlock; ++l)
+    {
+      double distanceHO = Distance(h, MPoint(ox[l], oy[l], oz[l]));
+      double distanceHC = Distance(h, MPoint(cx[l], cy[l], cz[l]));
+      double distanceNC = Distance(n, MPoint(cx[l], cy[l], cz[l]));
+      double distanceNO = Distance(n, MPoint(ox[l], oy[l], oz[l]));
+
+      energy[l] = kCouplingConstant / distanceHO - kCouplingConstant / distanceHC + kCouplingConstant / distanceNC - kCouplingConstant / distanceNO;
+      shortest[l] = std::min(std::min(distanceHO, distanceHC),
+                             std::min(distanceNC, distanceNO));
+    }
+#endif
+
+    for (uint32 l = 0; l < kAcceptorBlock; ++l)
+      outEnergies[k + l] = ClampHBondEnergy(energy[l], shortest[l]);
   }
+}
 
-  // and acceptor
-  if (result < inAcceptor.mHBondDonor[0].energy)
+// keep the two best bonds, a bond only replaces one that is strictly worse
+void StoreHBond(HBond* ioBonds, MResidue* inPartner, double inEnergy)
+{
+  if (inEnergy < ioBonds[0].energy)
   {
-    inAcceptor.mHBondDonor[1] = inAcceptor.mHBondDonor[0];
-    inAcceptor.mHBondDonor[0].residue = &inDonor;
-    inAcceptor.mHBondDonor[0].energy = result;
+    ioBonds[1] = ioBonds[0];
+    ioBonds[0].residue = inPartner;
+    ioBonds[0].energy = inEnergy;
   }
-  else if (result < inAcceptor.mHBondDonor[1].energy)
+  else if (inEnergy < ioBonds[1].energy)
   {
-    inAcceptor.mHBondDonor[1].residue = &inDonor;
-    inAcceptor.mHBondDonor[1].energy = result;
+    ioBonds[1].residue = inPartner;
+    ioBonds[1].energy = inEnergy;
   }
+}
+
+double MResidue::CalculateHBondEnergy(MResidue& inDonor, MResidue& inAcceptor)
+{
+  double result = HBondEnergy(inDonor, inAcceptor);
+
+  StoreHBond(inDonor.mHBondAcceptor, &inAcceptor, result);
+  StoreHBond(inAcceptor.mHBondDonor, &inDonor, result);
 
   return result;
 }
@@ -755,29 +1230,9 @@ bool MResidue::AtomIntersectsBox(const MAtom& atom, double inRadius) const
     atom.mLoc.mZ - inRadius <= mBox[1].mZ;
 }
 
-void MResidue::CalculateSurface(const std::vector<MResidue*>& inResidues)
-{
-  std::vector<MResidue*> neighbours;
-
-  foreach (MResidue* r, inResidues)
-  {
-    MPoint center;
-    double radius;
-    r->GetCenterAndRadius(center, radius);
-
-    if (Distance(mCenter, center) < mRadius + radius)
-      neighbours.push_back(r);
-  }
-
-  mAccessibility = CalculateSurface(mN, kRadiusN, neighbours) +
-           CalculateSurface(mCA, kRadiusCA, neighbours) +
-           CalculateSurface(mC, kRadiusC, neighbours) +
-           CalculateSurface(mO, kRadiusO, neighbours);
-
-  foreach (const MAtom& atom, mSideChain)
-    mAccessibility += CalculateSurface(atom, kRadiusSideAtom, neighbours);
-}
-
+// Collects the atoms that may cover the surface of an atom. It also holds
+// the buffers CalculateSurface needs, keep one per thread and reuse it to
+// avoid allocating memory for every atom.
 class MAccumulator
 {
   public:
@@ -792,6 +1247,11 @@ class MAccumulator
         { return distance < rhs.distance; }
   };
 
+  void clear()
+  {
+    m_x.clear();
+  }
+
   void operator()(const MPoint& a, const MPoint& b, double d, double r)
   {
     double distance = DistanceSquared(a, b);
@@ -805,24 +1265,60 @@ class MAccumulator
     if (distance < test and distance > 0.0001)
     {
       candidate c = { b - a, r * r, distance };
-
       m_x.push_back(c);
-      push_heap(m_x.begin(), m_x.end());
     }
   }
 
+  // nearest first
   void sort()
   {
-    sort_heap(m_x.begin(), m_x.end());
+    std::sort(m_x.begin(), m_x.end());
   }
 
   std::vector<candidate>  m_x;
+
+  // the candidates as floats, and the residues near a residue
+  std::vector<float>    m_cx, m_cy, m_cz, m_cr;
+  std::vector<MResidue*>  m_neighbours;
 };
 
+void MResidue::CalculateSurface(const std::vector<MResidue*>& inResidues)
+{
+  MAccumulator scratch;
+  CalculateSurface(inResidues, scratch);
+}
+
+void MResidue::CalculateSurface(const std::vector<MResidue*>& inResidues,
+                                MAccumulator& ioScratch)
+{
+  std::vector<MResidue*>& neighbours = ioScratch.m_neighbours;
+  neighbours.clear();
+
+  foreach (MResidue* r, inResidues)
+  {
+    MPoint center;
+    double radius;
+    r->GetCenterAndRadius(center, radius);
+
+    if (Distance(mCenter, center) < mRadius + radius)
+      neighbours.push_back(r);
+  }
+
+  mAccessibility = CalculateSurface(mN, kRadiusN, neighbours, ioScratch) +
+           CalculateSurface(mCA, kRadiusCA, neighbours, ioScratch) +
+           CalculateSurface(mC, kRadiusC, neighbours, ioScratch) +
+           CalculateSurface(mO, kRadiusO, neighbours, ioScratch);
+
+  foreach (const MAtom& atom, mSideChain)
+    mAccessibility += CalculateSurface(atom, kRadiusSideAtom, neighbours,
+                                       ioScratch);
+}
+
 double MResidue::CalculateSurface(const MAtom& inAtom, double inRadius,
-                                  const std::vector<MResidue*>& inResidues)
+                                  const std::vector<MResidue*>& inResidues,
+                                  MAccumulator& accumulate)
 {
-  MAccumulator accumulate;
+  accumulate.clear();
 
   foreach (MResidue* r, inResidues)
   {
@@ -845,13 +1341,65 @@ double MResidue::CalculateSurface(const MAtom& inAtom, double inRadius,
 
   MSurfaceDots& surfaceDots = MSurfaceDots::Instance();
 
+  // The candidates, nearest first, as floats in one array per field. A dot
+  // is tested against a block of kCandidateBlock candidates at a time.
+  // The arrays are padded with candidates that cover nothing.
+  const std::vector<MAccumulator::candidate>& candidates = accumulate.m_x;
+  uint32 n = static_cast<uint32>(candidates.size());
+  uint32 padded = (n + kCandidateBlock - 1) / kCandidateBlock * kCandidateBlock;
+
+  std::vector<float>& cx = accumulate.m_cx;
+  std::vector<float>& cy = accumulate.m_cy;
+  std::vector<float>& cz = accumulate.m_cz;
+  std::vector<float>& cr = accumulate.m_cr;
+
+  cx.assign(padded, 0);
+  cy.assign(padded, 0);
+  cz.assign(padded, 0);
+  cr.assign(padded, -1);
+
+  for (uint32 k = 0; k < n; ++k)
+  {
+    cx[k] = static_cast<float>(candidates[k].location.mX);
+    cy[k] = static_cast<float>(candidates[k].location.mY);
+    cz[k] = static_cast<float>(candidates[k].location.mZ);
+    cr[k] = static_cast<float>(candidates[k].radius);
+  }
+
+  // Dots within this margin of a candidate surface are tested again in
+  // double precision, which makes the result exactly the same as testing
+  // all in double precision. Float rounding errors are far smaller.
+  const float kMargin = 1e-3f;
+
   for (uint32 i = 0; i < surfaceDots.size(); ++i)
   {
-    MPoint xx = surfaceDots[i] * radius;
+    float x = surfaceDots.x()[i] * static_cast<float>(radius),
+          y = surfaceDots.y()[i] * static_cast<float>(radius),
+          z = surfaceDots.z()[i] * static_cast<float>(radius);
 
     bool free = true;
-    for (uint32 k = 0; free and k < accumulate.m_x.size(); ++k)
-      free = accumulate.m_x[k].radius < DistanceSquared(xx, accumulate.m_x[k].location);
+    for (uint32 k = 0; free and k < padded; k += kCandidateBlock)
+    {
+      float d[kCandidateBlock];
+      for (uint32 l = 0; l < kCandidateBlock; ++l)
+      {
+        float dx = x - cx[k + l], dy = y - cy[k + l], dz = z - cz[k + l];
+        d[l] = cr[k + l] - (dx * dx + dy * dy + dz * dz);
+      }
+
+      float deepest = d[0];
+      for (uint32 l = 1; l < kCandidateBlock; ++l)
+        deepest = std::max(deepest, d[l]);
+
+      if (deepest > kMargin)
+        free = false;
+      else if (deepest >= -kMargin)
+      {
+        MPoint xx = surfaceDots[i] * radius;
+        for (uint32 l = k; free and l < k + kCandidateBlock and l < n; ++l)
+          free = candidates[l].radius < DistanceSquared(xx, candidates[l].location);
+      }
+    }
 
     if (free)
       surface += surfaceDots.weight();
@@ -867,8 +1415,8 @@ void MResidue::Translate(const MPoint& inTranslation)
   mC.Translate(inTranslation);
   mO.Translate(inTranslation);
   mH.Translate(inTranslation);
-  for_each(mSideChain.begin(), mSideChain.end(),
-           boost::bind(&MAtom::Translate, _1, inTranslation));
+  std::for_each(mSideChain.begin(), mSideChain.end(),
+                boost::bind(&MAtom::Translate, _1, inTranslation));
 }
 
 void MResidue::Rotate(const MQuaternion& inRotation)
@@ -878,8 +1426,8 @@ void MResidue::Rotate(const MQuaternion& inRotation)
   mC.Rotate(inRotation);
   mO.Rotate(inRotation);
   mH.Rotate(inRotation);
-  for_each(mSideChain.begin(), mSideChain.end(),
-           boost::bind(&MAtom::Rotate, _1, inRotation));
+  std::for_each(mSideChain.begin(), mSideChain.end(),
+                boost::bind(&MAtom::Rotate, _1, inRotation));
 }
 
 void MResidue::GetPoints(std::vector<MPoint>& outPoints) const
@@ -899,54 +1447,20 @@ void MResidue::WritePDB(std::ostream& os)
   mC.WritePDB(os);
   mO.WritePDB(os);
 
-  for_each(mSideChain.begin(), mSideChain.end(),
+  std::for_each(mSideChain.begin(), mSideChain.end(),
            boost::bind(&MAtom::WritePDB, _1, boost::ref(os)));
 }
 
 // --------------------------------------------------------------------
 
-MChain::MChain(const MChain& chain)
-  : mChainID(chain.mChainID)
+void MChain::SetChainID(const std::string& inChainID)
 {
-  MResidue* previous = nullptr;
-
-  foreach (const MResidue* residue, chain.mResidues)
-  {
-    MResidue* newResidue = new MResidue(*residue);
-    newResidue->SetPrev(previous);
-    mResidues.push_back(newResidue);
-    previous = newResidue;
-  }
+  mChainID = inChainID;
+  for_each(mResidues.begin(), mResidues.end(),
+           boost::bind(&MResidue::SetChainID, _1, inChainID));
 }
 
-MChain::~MChain()
-{
-  foreach (MResidue* residue, mResidues)
-    delete residue;
-}
-
-MChain& MChain::operator=(const MChain& chain)
-{
-  foreach (MResidue* residue, mResidues)
-    delete residue;
-  mResidues.clear();
-
-  foreach (const MResidue* residue, chain.mResidues)
-    mResidues.push_back(new MResidue(*residue));
-
-  mChainID = chain.mChainID;
-
-  return *this;
-}
-
-void MChain::SetChainID(const std::string& inChainID)
-{
-  mChainID = inChainID;
-  for_each(mResidues.begin(), mResidues.end(),
-           boost::bind(&MResidue::SetChainID, _1, inChainID));
-}
-
-void MChain::SetAuthChainID(const std::string& inAuthChainID)
+void MChain::SetAuthChainID(const std::string& inAuthChainID)
 {
   mAuthChainID = inAuthChainID;
 }
@@ -997,6 +1511,53 @@ void MChain::GetSequence(std::string& outSequence) const
     outSequence += kResidueInfo[r->GetType()].code;
 }
 
+// --------------------------------------------------------------------
+// ReadPDB takes its lines straight from the buffer of an MLineReader, the
+// columns of atom records are parsed in place.
+
+namespace
+{
+
+// The strings in atom records are mostly at most four characters long,
+// packed in a number they map to the string pool without taking its lock.
+// ReadmmCIF uses this as well.
+class MAtomStrings
+{
+  public:
+  uint32        Intern(const char* inBegin, const char* inEnd);
+  uint32        InternTrimmed(const char* inBegin, const char* inEnd);
+
+  private:
+  std::unordered_map<uint64, uint32>
+            mIDs;
+};
+
+uint32 MAtomStrings::Intern(const char* inBegin, const char* inEnd)
+{
+  if (inEnd - inBegin > 4)
+    return MStringPool::Intern(std::string(inBegin, inEnd));
+
+  uint64 key = uint64(inEnd - inBegin) << 32;
+  for (const char* ch = inBegin; ch != inEnd; ++ch)
+    key = key | uint64(uint8(*ch)) << (8 * (ch - inBegin));
+
+  auto i = mIDs.find(key);
+  if (i == mIDs.end())
+    i = mIDs.emplace(key, MStringPool::Intern(std::string(inBegin, inEnd))).first;
+  return i->second;
+}
+
+uint32 MAtomStrings::InternTrimmed(const char* inBegin, const char* inEnd)
+{
+  while (inBegin != inEnd and isspace(*inBegin))
+    ++inBegin;
+  while (inEnd != inBegin and isspace(inEnd[-1]))
+    --inEnd;
+  return Intern(inBegin, inEnd);
+}
+
+}
+
 // --------------------------------------------------------------------
 
 struct MResidueID
@@ -1038,7 +1599,7 @@ MProtein::MProtein()
             mLaddersPerSheetHistogram + kHistogramSize, 0);
 }
 
-MProtein::MProtein(const std::string& inID, MChain* inChain)
+MProtein::MProtein(const std::string& inID, const std::string& inSequence)
   : mID(inID)
   , mChainBreaks(0)
   , mIgnoredWaterMolecules(0)
@@ -1053,13 +1614,29 @@ MProtein::MProtein(const std::string& inID, MChain* inChain)
   std::fill(mLaddersPerSheetHistogram,
             mLaddersPerSheetHistogram + kHistogramSize, 0);
 
-  mChains.push_back(inChain);
+  MChain* chain = mArena.New<MChain>("A");
+  std::vector<MResidue*>& residues = chain->GetResidues();
+  MResidue* last = nullptr;
+  int32 nr = 1;
+  foreach (char r, inSequence)
+  {
+    residues.push_back(mArena.New<MResidue>(nr, r, last));
+    ++nr;
+    last = residues.back();
+  }
+
+  mChains.push_back(chain);
 }
 
 MProtein::~MProtein()
 {
+  // the memory itself is released by the arena
   foreach (MChain* chain, mChains)
-    delete chain;
+  {
+    foreach (MResidue* residue, chain->GetResidues())
+      residue->~MResidue();
+    chain->~MChain();
+  }
 }
 
 void MProtein::ReadPDB(std::istream& is, bool cAlphaOnly)
@@ -1084,17 +1661,132 @@ void MProtein::ReadPDB(std::istream& is, bool cAlphaOnly)
   std::vector<MAtom> atoms;
   char firstAltLoc = 0;
   bool atomSeen = false;
-  optional<MAtom> prevAtom;
+  MAtom prevAtom = {};
+  bool hasPrevAtom = false;
 
-  while (not is.eof())
-  {
-    std::string line;
-    getline(is, line);
-    if (line.empty() and is.eof())
-      break;
+  MLineReader reader(is);
+  MAtomStrings strings;
+  const char* begin;
+  const char* end;
 
+  while (reader.Next(begin, end))
+  {
     if (VERBOSE > 3)
-      std::cerr << line << std::endl;
+      std::cerr.write(begin, end - begin) << std::endl;
+
+    // by far the most lines are atom records, these are parsed in place
+    if (end - begin >= 6 and
+        (strncmp(begin, "ATOM  ", 6) == 0 or strncmp(begin, "HETATM", 6) == 0))
+      //  1 - 6  Record name "ATOM "
+    {
+      if (end - begin < 80)
+      {
+        if (VERBOSE)
+          std::cerr << "Skipping ATOM/HETATM line because it's shorter than 80 characters" << std::endl;
+
+        continue;
+      }
+
+      if (cAlphaOnly and strncmp(begin + 12, " CA ", 4) != 0)
+      {
+        if (VERBOSE)
+          std::cerr << "Skipping ATOM/HETATM " << ba::trim_copy(std::string(begin + 12, 4))
+                    << " line because this is a C-alpha only file" << std::endl;
+        continue;
+      }
+
+      atomSeen = begin[0] == 'A';
+
+      MAtom atom = {};
+
+      //  7 - 11  Integer serial Atom serial number.
+      atom.mSerial = ParseInteger(begin + 6, begin + 11);
+      //  13 - 16  Atom name Atom name.
+      atom.mName = strings.InternTrimmed(begin + 12, begin + 16);
+      //  17    Character altLoc Alternate location indicator.
+      atom.mAltLoc = begin[16];
+      //  18 - 20  Residue name resName Residue name.
+      atom.mResName = strings.InternTrimmed(begin + 17, begin + 21);
+      //  22    Character chainID Chain identifier.
+      atom.mChainID = strings.Intern(begin + 21, begin + 22);
+      atom.mAuthChainID = atom.mChainID;
+      //  23 - 26  Integer resSeq Residue sequence number.
+      atom.mResSeq = ParseInteger(begin + 22, begin + 26);
+      //  27    AChar iCode Code for insertion of residues.
+      atom.mICode = strings.Intern(begin + 26, begin + 27);
+
+      //  31 - 38  Real(8.3) x Orthogonal coordinates for X in Angstroms.
+      atom.mLoc.mX = ParseFloat(begin + 30, begin + 38);
+      //  39 - 46  Real(8.3) y Orthogonal coordinates for Y in Angstroms.
+      atom.mLoc.mY = ParseFloat(begin + 38, begin + 46);
+      //  47 - 54  Real(8.3) z Orthogonal coordinates for Z in Angstroms.
+      atom.mLoc.mZ = ParseFloat(begin + 46, begin + 54);
+      //  55 - 60  Real(6.2) occupancy Occupancy.
+      atom.mOccupancy = ParseFloat(begin + 54, begin + 60);
+      //  61 - 66  Real(6.2) tempFactor Temperature factor.
+      atom.mTempFactor = ParseFloat(begin + 60, begin + 66);
+
+      //  77 - 78  LString(2) element Element symbol, right-justified.
+      atom.mElement = strings.InternTrimmed(begin + 76, begin + 79);
+      //  79 - 80  LString(2) charge Charge on the atom.
+      atom.mCharge = 0;
+
+      // a new residue starts when the chain, number or insertion code changes
+      if (hasPrevAtom and
+          (atom.mChainID != prevAtom.mChainID or
+           atom.mResSeq != prevAtom.mResSeq or
+           atom.mICode != prevAtom.mICode))
+      {
+        if (not atoms.empty())
+        {
+          AddResidue(atoms);
+          atoms.clear();
+        }
+        firstAltLoc = 0;
+        hasPrevAtom = false;
+      }
+
+      try
+      {
+        atom.mType = MapElement(std::string(begin + 76, 2));
+      }
+      catch (const std::exception& e)
+      {
+        if (VERBOSE)
+          std::cerr << e.what() << std::endl;
+
+        continue;
+      }
+
+      if (atom.mType == kHydrogen)
+        continue;
+
+      prevAtom = atom;
+      hasPrevAtom = true;
+
+      if (atom.mAltLoc != ' ')
+      {
+        if (firstAltLoc == 0)
+          firstAltLoc = atom.mAltLoc;
+        if (atom.mAltLoc == firstAltLoc)
+          atom.mAltLoc = 'A';
+      }
+
+      if (firstAltLoc != 0 and
+          atom.mAltLoc != ' ' and
+          atom.mAltLoc != firstAltLoc)
+      {
+        if (VERBOSE)
+          std::cerr << "skipping alternate atom record " << atom.GetResName()
+                    << std::endl;
+        continue;
+      }
+
+      atoms.push_back(atom);
+      continue;
+    }
+
+    std::string line(begin, end);
 
     if (ba::starts_with(line, "HEADER"))
     {
@@ -1190,139 +1882,12 @@ void MProtein::ReadPDB(std::istream& is, bool cAlphaOnly)
       atoms.clear();
       firstAltLoc = 0;
       atomSeen = false;
-      prevAtom = none;
+      hasPrevAtom = false;
 
       terminatedChains.insert(line[21]);
 
       continue;
     }
-
-    if (ba::starts_with(line, "ATOM  ") or ba::starts_with(line, "HETATM"))
-      //  1 - 6  Record name "ATOM "
-    {
-      if (cAlphaOnly and line.substr(12, 4) != " CA ")
-      {
-        if (VERBOSE)
-          std::cerr << "Skipping ATOM/HETATM " << ba::trim_copy(line.substr(12, 4))
-                    << " line because this is a C-alpha only file" << std::endl;
-        continue;
-      }
-
-      if (line.length() < 80)
-      {
-        if (VERBOSE)
-          std::cerr << "Skipping ATOM/HETATM line because it's shorter than 80 characters" << std::endl;
-
-        continue;
-      }
-
-      atomSeen = ba::starts_with(line, "ATOM  ");
-
-      MAtom atom = {};
-
-      //  7 - 11  Integer serial Atom serial number.
-      atom.mSerial = boost::lexical_cast<uint32>(
-          ba::trim_copy(line.substr(6, 5)));
-      //  13 - 16  Atom name Atom name.
-      atom.mName = ba::trim_copy(line.substr(12, 4));
-      //  17    Character altLoc Alternate location indicator.
-      atom.mAltLoc = line[16];
-      //  18 - 20  Residue name resName Residue name.
-      atom.mResName = ba::trim_copy(line.substr(17, 4));
-      //  22    Character chainID Chain identifier.
-      atom.mChainID = line[21];
-      atom.mAuthChainID = atom.mChainID;
-      //  23 - 26  Integer resSeq Residue sequence number.
-      atom.mResSeq = boost::lexical_cast<int64>(
-          ba::trim_copy(line.substr(22, 4)));
-      //  27    AChar iCode Code for insertion of residues.
-      atom.mICode = line.substr(26, 1);
-
-      //  31 - 38  Real(8.3) x Orthogonal coordinates for X in Angstroms.
-      atom.mLoc.mX = ParseFloat(line.substr(30, 8));
-      //  39 - 46  Real(8.3) y Orthogonal coordinates for Y in Angstroms.
-      atom.mLoc.mY = ParseFloat(line.substr(38, 8));
-      //  47 - 54  Real(8.3) z Orthogonal coordinates for Z in Angstroms.
-      atom.mLoc.mZ = ParseFloat(line.substr(46, 8));
-
-      //  55 - 60  Real(6.2) occupancy Occupancy.
-      if (line.length() > 54)
-      {
-        atom.mOccupancy = ParseFloat(line.substr(54, 6));
-      }
-
-      //  61 - 66  Real(6.2) tempFactor Temperature factor.
-      if (line.length() > 60)
-      {
-        atom.mTempFactor = ParseFloat(line.substr(60, 6));
-      }
-
-      //  77 - 78  LString(2) element Element symbol, right-justified.
-      if (line.length() > 76)
-        atom.mElement = ba::trim_copy(line.substr(76, 3));
-      //  79 - 80  LString(2) charge Charge on the atom.
-      atom.mCharge = 0;
-
-//      alternative test, check chain ID as well.
-      if (prevAtom
-          &&
-          (
-            atom.mChainID != prevAtom->mChainID
-            ||
-            atom.mResSeq  != prevAtom->mResSeq
-            ||
-            atom.mICode   != prevAtom->mICode
-          )
-        )
-//      if (not atoms.empty() and
-//        (atom.mResSeq != atoms.back().mResSeq or (atom.mResSeq == atoms.back().mResSeq and atom.mICode != atoms.back().mICode)))
-      {
-        if ( ! atoms.empty() )
-        {
-          AddResidue(atoms);
-          atoms.clear();
-        }
-        firstAltLoc = 0;
-        prevAtom    = none;
-      }
-
-      try
-      {
-        atom.mType = MapElement(line.substr(76, 2));
-      }
-      catch (const std::exception& e)
-      {
-        if (VERBOSE)
-          std::cerr << e.what() << std::endl;
-
-        continue;
-      }
-
-      if (atom.mType == kHydrogen)
-        continue;
-
-      prevAtom = atom;
-
-      if (atom.mAltLoc != ' ')
-      {
-        if (firstAltLoc == 0)
-          firstAltLoc = atom.mAltLoc;
-        if (atom.mAltLoc == firstAltLoc)
-          atom.mAltLoc = 'A';
-      }
-
-      if (firstAltLoc != 0 and
-          atom.mAltLoc != ' ' and
-          atom.mAltLoc != firstAltLoc)
-      {
-        if (VERBOSE)
-          std::cerr << "skipping alternate atom record " << atom.mResName
-                    << std::endl;
-        continue;
-      }
-
-      atoms.push_back(atom);
-    }
   }
 
   if (not atoms.empty())  // we have read atoms without a TER
@@ -1365,9 +1930,7 @@ void MProtein::ReadPDB(std::istream& is, bool cAlphaOnly)
     }
   }
 
-  mChains.erase(
-    remove_if(mChains.begin(), mChains.end(), boost::bind(&MChain::Empty, _1)),
-    mChains.end());
+  RemoveEmptyChains();
 
   if (VERBOSE and mIgnoredWaterMolecules)
     std::cerr << "Ignored " << mIgnoredWaterMolecules << " water molecules"
@@ -1395,11 +1958,153 @@ void MProtein::ReadmmCIF(std::istream& is, bool cAlphaOnly)
   std::vector<std::pair<MResidueID,MResidueID>> ssbonds;
   std::set<char> terminatedChains;
 
+  std::vector<MAtom> atoms;
+  char firstAltLoc = 0;
+
+  // remap label_seq_id to auth_seq_id
+  std::map<std::string, std::map<int64,int64> > seq_id_map;
+
+  bool hasModelNum = false;
+  int64 modelNum = 0;
+
+  MAtomStrings strings;
+  uint32 mappedChainID = 0;
+  int64 mappedSeqID = 0, mappedResSeq = 0;
+
+  // The atom sites are handed over in batches of rows while the file is
+  // read, of the other categories only the ones used below are kept.
+  auto readAtomSites = [&](const mmCIF::record& atomSite)
+  {
+    // find the columns once per batch, instead of looking up the fields by name in each row
+    int32 modelNumColumn = atomSite.column("pdbx_PDB_model_num"),
+          labelSeqIDColumn = atomSite.column("label_seq_id"),
+          idColumn = atomSite.column("id"),
+          atomIDColumn = atomSite.column("auth_atom_id"),
+          altIDColumn = atomSite.column("label_alt_id"),
+          compIDColumn = atomSite.column("auth_comp_id"),
+          asymIDColumn = atomSite.column("label_asym_id"),
+          authAsymIDColumn = atomSite.column("auth_asym_id"),
+          seqIDColumn = atomSite.column("auth_seq_id"),
+          insCodeColumn = atomSite.column("pdbx_PDB_ins_code"),
+          xColumn = atomSite.column("Cartn_x"),
+          yColumn = atomSite.column("Cartn_y"),
+          zColumn = atomSite.column("Cartn_z"),
+          occupancyColumn = atomSite.column("occupancy"),
+          tempFactorColumn = atomSite.column("B_iso_or_equiv"),
+          typeSymbolColumn = atomSite.column("type_symbol"),
+          chargeColumn = atomSite.column("pdbx_formal_charge");
+
+    foreach (const mmCIF::row& atom, atomSite)
+    {
+      // skip over NMR models other than the first
+      const mmCIF::field& model = atom.column(modelNumColumn);
+      if (!hasModelNum)
+      {
+        modelNum = model.is_null() ? 0 : model.as_int();
+        hasModelNum = true;
+      }
+      if ((model.is_null() ? 0 : model.as_int()) != modelNum)
+        continue;
+
+      const mmCIF::field& labelSeqID = atom.column(labelSeqIDColumn);
+
+      MAtom a;
+
+      a.mSerial = atom.column(idColumn).as_int();
+      boost::string_ref text = atom.column(atomIDColumn).text();
+      a.mName = strings.Intern(text.begin(), text.end());
+      text = atom.column(altIDColumn).text();
+      a.mAltLoc = text == "." ? ' ' : atom.column(altIDColumn).as_char();
+      text = atom.column(compIDColumn).text();
+      a.mResName = strings.Intern(text.begin(), text.end());
+      text = atom.column(asymIDColumn).text();
+      a.mChainID = strings.Intern(text.begin(), text.end());
+      text = atom.column(authAsymIDColumn).text();
+      a.mAuthChainID = strings.Intern(text.begin(), text.end());
+      a.mResSeq = atom.column(seqIDColumn).as_int();
+      text = atom.column(insCodeColumn).text();
+      a.mICode = text == "?" ? 0 : strings.Intern(text.begin(), text.end());
+
+      // map seq_id, once for all atoms of a residue
+      int64 seqID = labelSeqID.is_null() ? a.mResSeq : labelSeqID.as_int();
+      if (a.mChainID != mappedChainID or seqID != mappedSeqID or a.mResSeq != mappedResSeq)
+      {
+        seq_id_map[a.GetChainID()][seqID] = a.mResSeq;
+        mappedChainID = a.mChainID;
+        mappedSeqID = seqID;
+        mappedResSeq = a.mResSeq;
+      }
+
+      a.mLoc.mX = ParseFloat(atom.column(xColumn).text());
+      a.mLoc.mY = ParseFloat(atom.column(yColumn).text());
+      a.mLoc.mZ = ParseFloat(atom.column(zColumn).text());
+
+      a.mOccupancy = ParseFloat(atom.column(occupancyColumn).text());
+      a.mTempFactor = ParseFloat(atom.column(tempFactorColumn).text());
+      text = atom.column(typeSymbolColumn).text();
+      a.mElement = strings.Intern(text.begin(), text.end());
+      a.mCharge = atom.column(chargeColumn).text() != "?" ?
+        atom.column(chargeColumn).as_int() : 0;
+
+      try
+      {
+        a.mType = MapElement(a.GetElement());
+      }
+      catch (const std::exception& e)
+      {
+        if (VERBOSE)
+          std::cerr << e.what() << std::endl;
+
+        continue;
+      }
+
+      if (a.mType == kHydrogen)
+        continue;
+
+      if (not atoms.empty() and
+        (a.mChainID != atoms.back().mChainID or
+         (a.mResSeq != atoms.back().mResSeq or
+          (a.mResSeq == atoms.back().mResSeq and
+           a.mICode != atoms.back().mICode))))
+      {
+        AddResidue(atoms);
+        atoms.clear();
+        firstAltLoc = 0;
+      }
+
+      if (a.mAltLoc != ' ')
+      {
+        if (firstAltLoc == 0)
+          firstAltLoc = a.mAltLoc;
+        if (a.mAltLoc == firstAltLoc)
+          a.mAltLoc = 'A';
+      }
+
+      if (firstAltLoc != 0 and a.mAltLoc != ' ' and a.mAltLoc != firstAltLoc)
+      {
+        if (VERBOSE)
+          std::cerr << "skipping alternate atom record " << a.GetResName()
+                    << std::endl;
+        continue;
+      }
+
+      atoms.push_back(a);
+    }
+  };
+
   // Read the mmCIF data into a mmCIF file class
   // Using http://mmcif.rcsb.org/dictionaries/pdb-correspondence/pdb2mmcif-2010.html
   // as a reference.
 
-  mmCIF::file data(is);
+  const char* kCategories[] = {
+    "_entry", "_struct_keywords", "_database_PDB_rev", "_entity", "_struct",
+    "_entity_src_nat", "_entity_src_gen", "_pdbx_entity_src_syn",
+    "_audit_author", "_struct_conn"
+  };
+
+  mmCIF::file data(is,
+    std::vector<std::string>(kCategories, kCategories + sizeof(kCategories) / sizeof(const char*)),
+    "_atom_site", readAtomSites);
 
   // ID
   mID = data.get("_entry.id");
@@ -1465,100 +2170,6 @@ void MProtein::ReadmmCIF(std::istream& is, bool cAlphaOnly)
     ssbonds.push_back(ssbond);
   }
 
-  std::vector<MAtom> atoms;
-  char firstAltLoc = 0;
-
-  // remap label_seq_id to auth_seq_id
-  std::map<std::string, std::map<int64,int64> > seq_id_map;
-
-  bool hasModelNum = false;
-  int modelNum = 0;
-
-  foreach (const mmCIF::row& atom, data["_atom_site"])
-  {
-    // skip over NMR models other than the first
-    if (!hasModelNum)
-    {
-      modelNum = atoi(atom["pdbx_PDB_model_num"].c_str());
-      hasModelNum = true;
-    }
-    if (atoi(atom["pdbx_PDB_model_num"].c_str()) != modelNum)
-      continue;
-
-    std::string label_seq_id = atom["label_seq_id"];
-
-    MAtom a;
-
-    a.mSerial = boost::lexical_cast<uint32>(atom["id"]);
-    a.mName = atom["auth_atom_id"];
-    a.mAltLoc = atom["label_alt_id"] == "." ? ' ' : atom["label_alt_id"][0];
-    a.mResName = atom["auth_comp_id"];
-    a.mChainID = atom["label_asym_id"];
-    a.mAuthChainID = atom["auth_asym_id"];
-    a.mResSeq = boost::lexical_cast<uint32>(atom["auth_seq_id"]);
-    a.mICode = atom["pdbx_PDB_ins_code"] == "?" ? "" : atom["pdbx_PDB_ins_code"];
-
-    // map seq_id
-    if (label_seq_id == "?" or label_seq_id == ".")
-      seq_id_map[a.mChainID][a.mResSeq] = a.mResSeq;
-    else
-      seq_id_map[a.mChainID][boost::lexical_cast<int64>(label_seq_id)] = a.mResSeq;
-
-    a.mLoc.mX = ParseFloat(atom["Cartn_x"]);
-    a.mLoc.mY = ParseFloat(atom["Cartn_y"]);
-    a.mLoc.mZ = ParseFloat(atom["Cartn_z"]);
-
-    a.mOccupancy = ParseFloat(atom["occupancy"]);
-    a.mTempFactor = ParseFloat(atom["B_iso_or_equiv"]);
-    a.mElement = atom["type_symbol"];
-    a.mCharge = atom["pdbx_formal_charge"] != "?" ? boost::lexical_cast<int>(
-        atom["pdbx_formal_charge"]) : 0;
-
-    try
-    {
-      a.mType = MapElement(a.mElement);
-    }
-    catch (const std::exception& e)
-    {
-      if (VERBOSE)
-        std::cerr << e.what() << std::endl;
-
-      continue;
-    }
-
-    if (a.mType == kHydrogen)
-      continue;
-
-    if (not atoms.empty() and
-      (a.mChainID != atoms.back().mChainID or
-       (a.mResSeq != atoms.back().mResSeq or
-        (a.mResSeq == atoms.back().mResSeq and
-         a.mICode != atoms.back().mICode))))
-    {
-      AddResidue(atoms);
-      atoms.clear();
-      firstAltLoc = 0;
-    }
-
-    if (a.mAltLoc != ' ')
-    {
-      if (firstAltLoc == 0)
-        firstAltLoc = a.mAltLoc;
-      if (a.mAltLoc == firstAltLoc)
-        a.mAltLoc = 'A';
-    }
-
-    if (firstAltLoc != 0 and a.mAltLoc != ' ' and a.mAltLoc != firstAltLoc)
-    {
-      if (VERBOSE)
-        std::cerr << "skipping alternate atom record " << a.mResName
-                  << std::endl;
-      continue;
-    }
-
-    atoms.push_back(a);
-  }
-
   if (not atoms.empty())
   {
     AddResidue(atoms);
@@ -1598,9 +2209,7 @@ void MProtein::ReadmmCIF(std::istream& is, bool cAlphaOnly)
     }
   }
 
-  mChains.erase(remove_if(mChains.begin(), mChains.end(),
-                          boost::bind(&MChain::Empty, _1)),
-                          mChains.end());
+  RemoveEmptyChains();
 
   if (VERBOSE and mIgnoredWaterMolecules)
     std::cerr << "Ignored " << mIgnoredWaterMolecules << " water molecules"
@@ -1733,8 +2342,8 @@ void MProtein::AddResidue(const std::vector<MAtom>& inAtoms)
 
   if (hasN and hasCA and hasC and hasO)
   {
-    MChain& chain = GetChain(inAtoms.front().mChainID);
-    chain.SetAuthChainID(inAtoms.front().mAuthChainID);
+    MChain& chain = GetChain(inAtoms.front().GetChainID());
+    chain.SetAuthChainID(inAtoms.front().GetAuthChainID());
 
     std::vector<MResidue*>& residues(chain.GetResidues());
 
@@ -1743,7 +2352,7 @@ void MProtein::AddResidue(const std::vector<MAtom>& inAtoms)
       prev = residues.back();
 
     int64 resNumber = mResidueCount + mChains.size() + mChainBreaks;
-    MResidue* r = new MResidue(resNumber, prev, inAtoms);
+    MResidue* r = mArena.New<MResidue>(resNumber, prev, inAtoms, mArena);
     // check for chain breaks
     if (prev != nullptr and not prev->ValidDistance(*r))
     {
@@ -1758,10 +2367,10 @@ void MProtein::AddResidue(const std::vector<MAtom>& inAtoms)
     residues.push_back(r);
     ++mResidueCount;
   }
-  else if (std::string(inAtoms.front().mResName) == "HOH")
+  else if (inAtoms.front().GetResName() == "HOH")
     ++mIgnoredWaterMolecules;
   else if (VERBOSE)
-    std::cerr << "ignoring incomplete residue " << inAtoms.front().mResName
+    std::cerr << "ignoring incomplete residue " << inAtoms.front().GetResName()
               << " (" << inAtoms.front().mResSeq << ')' << std::endl;
 }
 
@@ -1781,10 +2390,21 @@ MChain& MProtein::GetChain(const std::string& inChainID)
     if (mChains[i]->GetChainID() == inChainID)
       return *mChains[i];
 
-  mChains.push_back(new MChain(inChainID));
+  mChains.push_back(mArena.New<MChain>(inChainID));
   return *mChains.back();
 }
 
+void MProtein::RemoveEmptyChains()
+{
+  std::vector<MChain*>::iterator empty = std::stable_partition(mChains.begin(),
+    mChains.end(), [](const MChain* chain) { return not chain->Empty(); });
+
+  for (std::vector<MChain*>::iterator chain = empty; chain != mChains.end(); ++chain)
+    (*chain)->~MChain();
+
+  mChains.erase(empty, mChains.end());
+}
+
 void MProtein::GetPoints(std::vector<MPoint>& outPoints) const
 {
   foreach (const MChain* chain, mChains)
@@ -1811,6 +2431,13 @@ void MProtein::Rotate(const MQuaternion& inRotation)
 }
 
 void MProtein::CalculateSecondaryStructure(bool inPreferPiHelices)
+{
+  MScheduler scheduler(boost::thread::hardware_concurrency());
+  CalculateSecondaryStructure(scheduler, inPreferPiHelices);
+}
+
+void MProtein::CalculateSecondaryStructure(MScheduler& inScheduler,
+                                           bool inPreferPiHelices)
 {
   std::vector<MResidue*> residues;
   residues.reserve(mResidueCount);
@@ -1823,37 +2450,102 @@ void MProtein::CalculateSecondaryStructure(bool inPreferPiHelices)
   if (VERBOSE)
     std::cerr << "using " << residues.size() << " residues" << std::endl;
 
-  boost::thread t(boost::bind(&MProtein::CalculateAccessibilities, this,
-                  boost::ref(residues)));
+  // both the H-bond energies and the accessibilities need the residues
+  // near each residue
+  MResidueGrid grid(residues);
 
-  CalculateHBondEnergies(residues);
-  CalculateBetaSheets(residues);
-  CalculateAlphaHelices(residues, inPreferPiHelices);
-
-  t.join();
+  // the accessibilities do not depend on the H-bonds
+  inScheduler.Run(2, [&](uint32 inTask) {
+    if (inTask == 0)
+      CalculateAccessibilities(residues, grid, inScheduler);
+    else
+    {
+      CalculateHBondEnergies(residues, grid, inScheduler);
+      CalculateBetaSheets(residues);
+      CalculateAlphaHelices(residues, inPreferPiHelices);
+    }
+  });
 }
 
-void MProtein::CalculateHBondEnergies(const std::vector<MResidue*>& inResidues)
+void MProtein::CalculateHBondEnergies(const std::vector<MResidue*>& inResidues,
+                                      const MResidueGrid& inGrid,
+                                      MScheduler& inScheduler)
 {
   if (VERBOSE)
     std::cerr << "Calculate H-bond energies" << std::endl;
 
-  // Calculate the HBond energies
-  for (uint32 i = 0; i + 1 < inResidues.size(); ++i)
+  // A serial scan over all pairs i < j stores the bonds i -> j and, unless
+  // j is i + 1, j -> i. Since StoreHBond keeps the first of two equal
+  // bonds, each residue ends up with its best partners in the order of
+  // their index.
+  //
+  // Here every task takes a block of donors and stores their acceptors in
+  // index order right away. The bonds for the acceptor side are collected
+  // per task, and stored afterwards going over the tasks in order, which
+  // gives the same index order.
+
+  struct MDonorBond
   {
-    MResidue* ri = inResidues[i];
+    uint32 donor, acceptor;
+    double energy;
+  };
+
+  // The C-alpha of a candidate is near the center of its residue
+  double range = kMinimalCADistance + inGrid.MaxCAlphaOffset() + 0.001;
+
+  const uint32 kBlockSize = 256;
+  uint32 n = inResidues.size();
+  uint32 blocks = (n + kBlockSize - 1) / kBlockSize;
 
-    for (uint32 j = i + 1; j < inResidues.size(); ++j)
+  std::vector<std::vector<MDonorBond>> bonds(blocks);
+
+  inScheduler.Run(blocks, [&](uint32 inBlock) {
+    std::vector<uint32> near;
+    MAcceptorBlocks acceptors;
+    std::vector<double> energies;
+    std::vector<MDonorBond>& found = bonds[inBlock];
+
+    uint32 end = std::min(n, (inBlock + 1) * kBlockSize);
+    for (uint32 d = inBlock * kBlockSize; d < end; ++d)
     {
-      MResidue* rj = inResidues[j];
+      MResidue* donor = inResidues[d];
+
+      // a proline has no hydrogen to donate
+      if (donor->GetType() == kProline)
+        continue;
+
+      inGrid.Near(donor->GetCAlpha(), range, near);
+
+      acceptors.reset(near.size());
+      foreach (uint32 a, near)
+      {
+        if (a != d and a + 1 != d and
+            Distance(donor->GetCAlpha(), inResidues[a]->GetCAlpha()) < kMinimalCADistance)
+          acceptors.add(a, *inResidues[a]);
+      }
 
-      if (Distance(ri->GetCAlpha(), rj->GetCAlpha()) < kMinimalCADistance)
+      CalculateAcceptorEnergies(*donor, acceptors, energies);
+
+      for (uint32 k = 0; k < acceptors.count; ++k)
       {
-        MResidue::CalculateHBondEnergy(*ri, *rj);
-        if (j != i + 1)
-          MResidue::CalculateHBondEnergy(*rj, *ri);
+        // only bonds with a negative energy are ever stored
+        if (energies[k] < 0)
+        {
+          uint32 a = acceptors.residues[k];
+          StoreHBond(donor->Acceptor(), inResidues[a], energies[k]);
+
+          MDonorBond bond = { d, a, energies[k] };
+          found.push_back(bond);
+        }
       }
     }
+  });
+
+  foreach (const std::vector<MDonorBond>& found, bonds)
+  {
+    foreach (const MDonorBond& bond, found)
+      StoreHBond(inResidues[bond.acceptor]->Donor(), inResidues[bond.donor],
+                 bond.energy);
   }
 }
 
@@ -1968,56 +2660,96 @@ void MProtein::CalculateBetaSheets(const std::vector<MResidue*>& inResidues)
     std::cerr << "Calculate beta sheets" << std::endl;
 
   // Calculate Bridges
+  //
+  // Each of the patterns tested by TestBridge contains an H-bond between
+  // one of i, i+1 and one of j-1, j, j+1. So only pairs of residues linked
+  // by one of the two H-bonds stored per residue are candidates, these are
+  // collected and tested in the same order as a scan over all pairs would.
   std::vector<MBridge> bridges;
   if (inResidues.size() > 4)
   {
-    for (uint32 i = 1; i + 4 < inResidues.size(); ++i)
-    {
-      MResidue* ri = inResidues[i];
+    uint32 n = inResidues.size();
 
-      for (uint32 j = i + 3; j + 1 < inResidues.size(); ++j)
-      {
-        MResidue* rj = inResidues[j];
+    std::unordered_map<const MResidue*, uint32> index;
+    index.reserve(n);
+    for (uint32 i = 0; i < n; ++i)
+      index[inResidues[i]] = i;
+
+    std::vector<std::pair<uint32, uint32>> candidates;
+    candidates.reserve(8 * n);
 
-        MBridgeType type = ri->TestBridge(rj);
-        if (type == btNoBridge)
+    auto addCandidate = [&](int64 i, int64 j) {
+      if (i >= 1 and i + 4 < n and j >= i + 3 and j + 1 < n)
+        candidates.push_back(std::make_pair(uint32(i), uint32(j)));
+    };
+
+    for (uint32 y = 0; y < n; ++y)
+    {
+      for (uint32 k = 0; k < 2; ++k)
+      {
+        const HBond& hbond = inResidues[y]->Acceptor()[k];
+        if (hbond.residue == nullptr or hbond.energy >= kMaxHBondEnergy)
           continue;
 
-        bool found = false;
-        foreach (MBridge& bridge, bridges)
-        {
-          if (type != bridge.type or i != bridge.i.back() + 1)
-            continue;
+        int64 x = index[hbond.residue];
 
-          if (type == btParallel and bridge.j.back() + 1 == j)
-          {
-            bridge.i.push_back(i);
-            bridge.j.push_back(j);
-            found = true;
-            break;
-          }
+        addCandidate(y - 1, x);      // c -> e
+        addCandidate(x, y - 1);      // f -> b
+        addCandidate(y - 1, x + 1);  // c -> d
+        addCandidate(x, y);          // e -> b
+      }
+    }
 
-          if (type == btAntiParallel and bridge.j.front() - 1 == j)
-          {
-            bridge.i.push_back(i);
-            bridge.j.push_front(j);
-            found = true;
-            break;
-          }
-        }
+    sort(candidates.begin(), candidates.end());
+    candidates.erase(unique(candidates.begin(), candidates.end()),
+                     candidates.end());
 
-        if (not found)
-        {
-          MBridge bridge = {};
+    // the bridges that can still be extended, keyed by type and their last
+    // pair of residues
+    std::unordered_map<uint64, uint32> ladderEnds;
+    auto ladderKey = [](MBridgeType type, uint32 i, uint32 j) -> uint64 {
+      return (uint64(i) << 33) | (uint64(j) << 1) | (type == btParallel);
+    };
+
+    typedef std::pair<uint32, uint32> candidate;
+    foreach (const candidate& c, candidates)
+    {
+      uint32 i = c.first, j = c.second;
+      MResidue* ri = inResidues[i];
+      MResidue* rj = inResidues[j];
 
-          bridge.type = type;
-          bridge.i.push_back(i);
-          bridge.chainI = ri->GetChainID();
+      MBridgeType type = ri->TestBridge(rj);
+      if (type == btNoBridge)
+        continue;
+
+      auto l = ladderEnds.find(type == btParallel ?
+        ladderKey(type, i - 1, j - 1) : ladderKey(type, i - 1, j + 1));
+
+      if (l != ladderEnds.end())
+      {
+        uint32 b = l->second;
+        ladderEnds.erase(l);
+        ladderEnds[ladderKey(type, i, j)] = b;
+
+        MBridge& bridge = bridges[b];
+        bridge.i.push_back(i);
+        if (type == btParallel)
           bridge.j.push_back(j);
-          bridge.chainJ = rj->GetChainID();
+        else
+          bridge.j.push_front(j);
+      }
+      else
+      {
+        MBridge bridge = {};
 
-          bridges.push_back(bridge);
-        }
+        bridge.type = type;
+        bridge.i.push_back(i);
+        bridge.chainI = ri->GetChainID();
+        bridge.j.push_back(j);
+        bridge.chainJ = rj->GetChainID();
+
+        ladderEnds[ladderKey(type, i, j)] = bridges.size();
+        bridges.push_back(bridge);
       }
     }
   }
@@ -2072,10 +2804,25 @@ void MProtein::CalculateBetaSheets(const std::vector<MResidue*>& inResidues)
   }
 
   // Sheet
-  std::set<MBridge*> ladderset;
-  foreach (MBridge& bridge, bridges)
+  //
+  // Ladders sharing a residue are in the same sheet. Sheets are numbered in
+  // the order of their first ladder and ladders in the order of the sheets.
+  MLadderSets ladderSets(bridges.size());
+  std::vector<int64> lastLadder(inResidues.size(), -1);
+
+  for (uint32 l = 0; l < bridges.size(); ++l)
   {
-    ladderset.insert(&bridge);
+    MBridge& bridge = bridges[l];
+
+    for (std::deque<uint32>* residues : { &bridge.i, &bridge.j })
+    {
+      foreach (uint32 r, *residues)
+      {
+        if (lastLadder[r] >= 0)
+          ladderSets.Join(lastLadder[r], l);
+        lastLadder[r] = l;
+      }
+    }
 
     uint32 n = bridge.i.size();
     if (n > kHistogramSize)
@@ -2087,47 +2834,34 @@ void MProtein::CalculateBetaSheets(const std::vector<MResidue*>& inResidues)
       mAntiparallelBridgesPerLadderHistogram[n - 1] += 1;
   }
 
-  uint32 sheet = 1, ladder = 0;
-  while (not ladderset.empty())
+  std::vector<std::vector<uint32>> sheets;
+  std::vector<uint32> sheetForRoot(bridges.size());
+  for (uint32 l = 0; l < bridges.size(); ++l)
   {
-    std::set<MBridge*> sheetset;
-    sheetset.insert(*ladderset.begin());
-    ladderset.erase(ladderset.begin());
-
-    bool done = false;
-    while (not done)
+    uint32 root = ladderSets.Root(l);
+    if (root == l)
     {
-      done = true;
-      foreach (MBridge* a, sheetset)
-      {
-        foreach (MBridge* b, ladderset)
-        {
-          if (Linked(*a, *b))
-          {
-            sheetset.insert(b);
-            ladderset.erase(b);
-            done = false;
-            break;
-          }
-        }
-        if (not done)
-          break;
-      }
+      sheetForRoot[l] = sheets.size();
+      sheets.push_back(std::vector<uint32>());
     }
+    sheets[sheetForRoot[root]].push_back(l);
+  }
 
-    foreach (MBridge* bridge, sheetset)
+  uint32 sheet = 1, ladder = 0;
+  foreach (const std::vector<uint32>& ladders, sheets)
+  {
+    foreach (uint32 l, ladders)
     {
-      bridge->ladder = ladder;
-      bridge->sheet = sheet;
-      bridge->link = sheetset;
+      bridges[l].ladder = ladder;
+      bridges[l].sheet = sheet;
 
       ++ladder;
     }
 
-    uint32 nrOfLaddersPerSheet = sheetset.size();
+    uint32 nrOfLaddersPerSheet = ladders.size();
     if (nrOfLaddersPerSheet > kHistogramSize)
       nrOfLaddersPerSheet = kHistogramSize;
-    if (nrOfLaddersPerSheet == 1 and (*sheetset.begin())->i.size() > 1)
+    if (nrOfLaddersPerSheet == 1 and bridges[ladders.front()].i.size() > 1)
       mLaddersPerSheetHistogram[0] += 1;
     else if (nrOfLaddersPerSheet > 1)
       mLaddersPerSheetHistogram[nrOfLaddersPerSheet - 1] += 1;
@@ -2210,52 +2944,42 @@ void MProtein::CalculateBetaSheets(const std::vector<MResidue*>& inResidues)
 }
 
 void MProtein::CalculateAccessibilities(
-    const std::vector<MResidue*>& inResidues)
+    const std::vector<MResidue*>& inResidues, const MResidueGrid& inGrid,
+    MScheduler& inScheduler)
 {
   if (VERBOSE)
     std::cerr << "Calculate accessibilities" << std::endl;
 
-  uint32 nr_of_threads = boost::thread::hardware_concurrency();
-  if (nr_of_threads <= 1)
-  {
-    foreach (MResidue* residue, inResidues)
-      residue->CalculateSurface(inResidues);
-  }
-  else
-  {
-    MResidueQueue queue;
-
-    boost::thread_group t;
-
-    for (uint32 ti = 0; ti < nr_of_threads; ++ti)
-      t.create_thread(boost::bind(&MProtein::CalculateAccessibility, this,
-        boost::ref(queue), boost::ref(inResidues)));
+  // make sure the MSurfaceDots is constructed once
+  (void)MSurfaceDots::Instance();
 
-    foreach (MResidue* residue, inResidues)
-      queue.put(residue);
+  std::atomic<uint32> next(0);
 
-    queue.put(nullptr);
+  inScheduler.Run(inScheduler.Size(), [&](uint32) {
+    std::vector<uint32> near;
+    std::vector<MResidue*> candidates;
+    MAccumulator scratch;
 
-    t.join_all();
-  }
-}
+    for (;;)
+    {
+      uint32 i = next++;
+      if (i >= inResidues.size())
+        break;
 
-void MProtein::CalculateAccessibility(MResidueQueue& inQueue,
-  const std::vector<MResidue*>& inResidues)
-{
-  // make sure the MSurfaceDots is constructed once
-  (void)MSurfaceDots::Instance();
+      // CalculateSurface keeps those that overlap this residue
+      MPoint center;
+      double radius;
+      inResidues[i]->GetCenterAndRadius(center, radius);
 
-  for (;;)
-  {
-    MResidue* residue = inQueue.get();
-    if (residue == nullptr)
-      break;
+      inGrid.Near(center, radius + inGrid.MaxRadius() + 0.001, near);
 
-    residue->CalculateSurface(inResidues);
-  }
+      candidates.clear();
+      foreach (uint32 j, near)
+        candidates.push_back(inResidues[j]);
 
-  inQueue.put(nullptr);
+      inResidues[i]->CalculateSurface(candidates, scratch);
+    }
+  });
 }
 
 void MProtein::Center()
@@ -2268,13 +2992,6 @@ void MProtein::Center()
   Translate(MPoint(-t.mX, -t.mY, -t.mZ));
 }
 
-void MProtein::SetChain(const std::string& inChainID, const MChain& inChain)
-{
-  MChain& chain(GetChain(inChainID));
-  chain = inChain;
-  chain.SetChainID(inChainID);
-}
-
 // Non-const overload, implemented in terms of the const overload
 MResidue* MProtein::GetResidue(const std::string& inChainID,
                                int64 inSeqNumber,
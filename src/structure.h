@@ -10,20 +10,24 @@
 #include "mas.h"
 #include "primitives-3d.h"
 
+#include <boost/range/iterator_range.hpp>
+
+#include <new>
+#include <utility>
+
 struct MAtom;
+class MAccumulator;
 class MResidue;
 class MChain;
 class MProtein;
-
-// forward declaration of buffer
-template<typename T, uint32 N> class buffer;
-typedef buffer<MResidue*,100>  MResidueQueue;
+class MResidueGrid;
+class MScheduler;
 
 const uint32 kHistogramSize = 30;
 
 // a limited set of known atoms. This is an obvious candidate for improvement
 // of DSSP.
-enum MAtomType
+enum MAtomType : uint8
 {
   kUnknownAtom,
   kHydrogen,
@@ -47,25 +51,53 @@ enum MAtomType
 
 MAtomType MapElement(std::string inElement);
 
-// for now, MAtom contains exactly what the ATOM line contains in a PDB file
+// The strings in atom records come from a small set: atom and residue
+// names, chain IDs, insertion codes and elements. Each distinct string is
+// stored once in this pool, shared by all proteins, and atoms refer to it
+// by number. The empty string is number 0.
+class MStringPool
+{
+  public:
+  static uint32    Intern(const std::string& inString);
+  static const std::string&
+            Get(uint32 inID);
+};
+
+// for now, MAtom contains exactly what the ATOM line contains in a PDB file,
+// the strings are numbers in the MStringPool.
 struct MAtom
 {
+  MPoint    mLoc;
   uint32    mSerial;
-  std::string  mName;
-  char    mAltLoc;
-  std::string  mResName;
-  std::string  mChainID, mAuthChainID;
   int32    mResSeq;
-  std::string  mICode;
+  float    mOccupancy;
+  float    mTempFactor;
+  uint32    mName, mResName, mChainID, mAuthChainID, mICode, mElement;
+  char    mAltLoc;
   MAtomType  mType;
-  MPoint    mLoc;
-  double    mOccupancy;
-  double    mTempFactor;
-  std::string  mElement;
-  int      mCharge;
+  int8    mCharge;
+
+  const std::string&
+        GetName() const              { return MStringPool::Get(mName); }
+  const std::string&
+        GetResName() const            { return MStringPool::Get(mResName); }
+  const std::string&
+        GetChainID() const            { return MStringPool::Get(mChainID); }
+  const std::string&
+        GetAuthChainID() const          { return MStringPool::Get(mAuthChainID); }
+  const std::string&
+        GetICode() const              { return MStringPool::Get(mICode); }
+  const std::string&
+        GetElement() const            { return MStringPool::Get(mElement); }
+
+  void    SetName(const std::string& inName)    { mName = MStringPool::Intern(inName); }
+  void    SetResName(const std::string& inName)  { mResName = MStringPool::Intern(inName); }
+  void    SetChainID(const std::string& inChainID){ mChainID = MStringPool::Intern(inChainID); }
+  void    SetAuthChainID(const std::string& inChainID)
+                          { mAuthChainID = MStringPool::Intern(inChainID); }
+  void    SetICode(const std::string& inICode)  { mICode = MStringPool::Intern(inICode); }
+  void    SetElement(const std::string& inElement){ mElement = MStringPool::Intern(inElement); }
 
-  void    SetChainID(const std::string& inChainID){ mChainID = inChainID;}
-  std::string  GetName() const              { return mName; }
   void    Translate(const MPoint& inTranslation)  { mLoc += inTranslation; }
   void    Rotate(const MQuaternion& inRotation)  { mLoc.Rotate(inRotation); }
   void    WritePDB(std::ostream& os) const;
@@ -150,13 +182,39 @@ enum MSecondaryStructure
   bend    // S
 };
 
+// The residues, chains and side chain atoms of a protein are allocated
+// from large blocks, which are all released at once with the protein.
+// Objects are not freed one by one, the protein calls their destructors.
+class MArena
+{
+  public:
+            MArena() : mFree(nullptr), mLeft(0) {}
+            MArena(MArena&& inArena);
+            ~MArena();
+
+  void*        Allocate(size_t inSize);
+
+  template<class T, class... Args>
+  T*          New(Args&&... inArgs)
+            {
+              return new (Allocate(sizeof(T))) T(std::forward<Args>(inArgs)...);
+            }
+
+  private:
+            MArena(const MArena&);
+  MArena&        operator=(const MArena&);
+
+  std::vector<char*>  mBlocks;
+  char*        mFree;
+  size_t        mLeft;
+};
+
 class MResidue
 {
   public:
-            MResidue(const MResidue& residue);
             MResidue(int32 inNumber, char inTypeCode, MResidue* inPrevious);
-            MResidue(int32 inNumber,
-              MResidue* inPrevious, const std::vector<MAtom>& inAtoms);
+            MResidue(int32 inNumber, MResidue* inPrevious,
+              const std::vector<MAtom>& inAtoms, MArena& ioArena);
 
   void        SetChainID(const std::string& inChainID);
   std::string      GetChainID() const        { return mChainID; }
@@ -237,14 +295,20 @@ class MResidue
   void        WritePDB(std::ostream& os);
 
   static double CalculateHBondEnergy(MResidue& inDonor, MResidue& inAcceptor);
+  // the energy alone, without storing the bond
+  static double HBondEnergy(const MResidue& inDonor, const MResidue& inAcceptor);
 
-  std::vector<MAtom>&  GetSideChain()        { return mSideChain; }
-  const std::vector<MAtom>&
-            GetSideChain() const    { return mSideChain; }
+  // the side chain atoms live in the arena of the protein
+  typedef boost::iterator_range<MAtom*> MSideChain;
+
+  const MSideChain&  GetSideChain() const    { return mSideChain; }
 
   void        GetPoints(std::vector<MPoint>& outPoints) const;
 
   void        CalculateSurface(const std::vector<MResidue*>& inResidues);
+  // the same, with buffers reused between calls on the same thread
+  void        CalculateSurface(const std::vector<MResidue*>& inResidues,
+                               MAccumulator& ioScratch);
 
   void        GetCenterAndRadius(MPoint& outCenter, double& outRadius) const
                           { outCenter = mCenter; outRadius = mRadius; }
@@ -255,7 +319,8 @@ class MResidue
 
   double        CalculateSurface(
               const MAtom& inAtom, double inRadius,
-              const std::vector<MResidue*>& inResidues);
+              const std::vector<MResidue*>& inResidues,
+              MAccumulator& ioAccumulator);
 
   bool        TestBond(const MResidue* other) const;
 
@@ -273,7 +338,7 @@ class MResidue
   MSecondaryStructure  mSecondaryStructure;
   MAtom        mC, mN, mCA, mO, mH;
   HBond        mHBondDonor[2], mHBondAcceptor[2];
-  std::vector<MAtom>  mSideChain;
+  MSideChain      mSideChain;
   MBridgeParner    mBetaPartner[2];
   uint32        mSheet;
   MHelixFlag      mHelixFlags[3];  //
@@ -283,6 +348,7 @@ class MResidue
   double        mRadius;
 
   private:
+            MResidue(const MResidue& residue);
   MResidue&      operator=(const MResidue& residue);
 };
 
@@ -290,11 +356,7 @@ class MChain
 {
   public:
 
-            MChain(const MChain& chain);
             MChain(const std::string& inChainID) : mChainID(inChainID) {}
-            ~MChain();
-
-  MChain&        operator=(const MChain& chain);
 
   std::string      GetChainID() const          { return mChainID; }
   void        SetChainID(const std::string& inChainID);
@@ -320,6 +382,9 @@ class MChain
   bool        Empty() const            { return mResidues.empty(); }
 
   private:
+            MChain(const MChain& chain);
+  MChain&        operator=(const MChain& chain);
+
   std::string      mChainID,
                    mAuthChainID;
   std::vector<MResidue*>
@@ -330,7 +395,9 @@ class MProtein
 {
   public:
             MProtein();
-            MProtein(const std::string& inID, MChain* inChain);
+            // a protein with one chain A, built from a sequence
+            MProtein(const std::string& inID, const std::string& inSequence);
+            MProtein(MProtein&& inProtein) = default;
             ~MProtein();
 
 //            MProtein(std::istream& is, bool inCAlphaOnly = false);
@@ -345,7 +412,10 @@ class MProtein
   std::string      GetAuthor() const;
   const std::vector<std::string>& GetDbRef() const { return mDbRef; }
 
+  // the first uses a scheduler with a thread per core
   void CalculateSecondaryStructure(bool inPreferPiHelices = true);
+  void CalculateSecondaryStructure(MScheduler& inScheduler,
+                                   bool inPreferPiHelices = true);
 
   void GetStatistics(uint32& outNrOfResidues, uint32& outNrOfChains,
        uint32& outNrOfSSBridges, uint32& outNrOfIntraChainSSBridges,
@@ -374,8 +444,6 @@ class MProtein
     return mChains.front()->GetChainID();
   }
 
-  void        SetChain(const std::string& inChainID, const MChain& inChain);
-
   MChain&        GetChain(const std::string& inChainID);
   const MChain&    GetChain(const std::string& inChainID) const;
 
@@ -409,21 +477,23 @@ class MProtein
   private:
 
   void AddResidue(const std::vector<MAtom>& inAtoms);
+  void RemoveEmptyChains();
 
-  void CalculateHBondEnergies(const std::vector<MResidue*>& inResidues);
+  void CalculateHBondEnergies(const std::vector<MResidue*>& inResidues,
+                              const MResidueGrid& inGrid,
+                              MScheduler& inScheduler);
   void CalculateAlphaHelices(const std::vector<MResidue*>& inResidues,
                              bool inPreferPiHelices);
   void CalculateBetaSheets(const std::vector<MResidue*>& inResidues);
-  void CalculateAccessibilities(const std::vector<MResidue*>& inResidues);
-
-  // a thread entry point
-  void        CalculateAccessibility(MResidueQueue& inQueue,
-              const std::vector<MResidue*>& inResidues);
+  void CalculateAccessibilities(const std::vector<MResidue*>& inResidues,
+                                const MResidueGrid& inGrid,
+                                MScheduler& inScheduler);
 
   std::string      mID, mHeader;
 
   std::vector<std::string> mDbRef;
   std::string      mCompound, mSource, mAuthor;
+  MArena        mArena;
   std::vector<MChain*> mChains;
   uint32        mResidueCount, mChainBreaks;
 
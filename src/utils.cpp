@@ -13,6 +13,7 @@
 #include <boost/thread.hpp>
 
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 
 namespace fs = boost::filesystem;
@@ -131,6 +132,48 @@ mas_exception::mas_exception(const boost::format& msg)
 
 // --------------------------------------------------------------------
 
+bool MLineReader::Next(const char*& outBegin, const char*& outEnd)
+{
+  for (;;)
+  {
+    char* begin = &mBuffer[0] + mBegin;
+    char* end = &mBuffer[0] + mEnd;
+
+    char* eol = static_cast<char*>(memchr(begin, '\n', end - begin));
+    if (eol != nullptr)
+    {
+      outBegin = begin;
+      outEnd = eol;
+      mBegin = eol + 1 - &mBuffer[0];
+      return true;
+    }
+
+    if (not mStream)
+    {
+      // a last line without a newline
+      if (begin == end)
+        return false;
+
+      outBegin = begin;
+      outEnd = end;
+      mBegin = mEnd;
+      return true;
+    }
+
+    // move the partial line to the front, make room for very long lines
+    std::copy(begin, end, mBuffer.begin());
+    mEnd -= mBegin;
+    mBegin = 0;
+    if (mEnd == mBuffer.size())
+      mBuffer.resize(2 * mBuffer.size());
+
+    mStream.read(&mBuffer[mEnd], mBuffer.size() - mEnd);
+    mEnd += mStream.gcount();
+  }
+}
+
+// --------------------------------------------------------------------
+
 #ifndef NDEBUG
 stats::~stats()
 {
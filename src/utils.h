@@ -19,6 +19,8 @@
 #ifndef NDEBUG
 #include <iostream>
 #endif
+#include <istream>
+#include <vector>
 #include <time.h>
 
 // --------------------------------------------------------------------
@@ -102,6 +104,25 @@ struct stats
 };
 #endif
 
+// --------------------------------------------------------------------
+// Reads a stream line by line, in large blocks and without copying the
+// lines out of its buffer.
+
+class MLineReader
+{
+  public:
+            MLineReader(std::istream& inStream, size_t inBufferSize = 1024 * 1024)
+              : mStream(inStream), mBuffer(inBufferSize), mBegin(0), mEnd(0) {}
+
+  // the next line, without the newline, valid until the next call
+  bool        Next(const char*& outBegin, const char*& outEnd);
+
+  private:
+  std::istream&    mStream;
+  std::vector<char>  mBuffer;
+  size_t        mBegin, mEnd;
+};
+
 // --------------------------------------------------------------------
 
 void WriteToFD(int inFD, const std::string& inText);
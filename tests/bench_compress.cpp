@@ -0,0 +1,147 @@
+// Throughput of the block compressor compared to the serial boost
+// compressors.
+//
+//   bench_compress [file [megabytes]]
+//
+// The input file (default test-data/small.sto) is repeated until it is the
+// requested size (default 32 MB) and then compressed with gzip and bzip2,
+// serially and with an increasing number of threads. Every result is
+// decompressed again to check that it reads back as the original.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "block-compressor.h"
+#include "scheduler.h"
+#include "utils.h"
+
+#include <boost/format.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/thread.hpp>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace io = boost::iostreams;
+
+int VERBOSE = 0;
+
+namespace
+{
+
+typedef std::chrono::steady_clock clock_type;
+
+std::string Decompress(const std::string& inData, MCompression inCompression)
+{
+  std::string result;
+
+  io::filtering_stream<io::input> in;
+  if (inCompression == eCompressGZip)
+    in.push(io::gzip_decompressor());
+  else
+    in.push(io::bzip2_decompressor());
+  in.push(io::array_source(inData.data(), inData.length()));
+
+  io::copy(in, io::back_inserter(result));
+  return result;
+}
+
+void Report(const std::string& inName, const std::string& inText,
+            const std::string& inCompressed, clock_type::duration inTime,
+            MCompression inCompression)
+{
+  double seconds = std::chrono::duration<double>(inTime).count();
+
+  std::cout << boost::format("%-24s %8.1f MB/s  %6.2f%%  %s")
+    % inName % (inText.length() / seconds / 1e6)
+    % (100.0 * inCompressed.length() / inText.length())
+    % (Decompress(inCompressed, inCompression) == inText ? "ok" : "MISMATCH")
+    << std::endl;
+}
+
+void Bench(const std::string& inText, MCompression inCompression,
+           const std::string& inName)
+{
+  std::ostringstream serial;
+  clock_type::time_point start = clock_type::now();
+  {
+    io::filtering_stream<io::output> out;
+    if (inCompression == eCompressGZip)
+      out.push(io::gzip_compressor());
+    else
+      out.push(io::bzip2_compressor());
+    out.push(serial);
+    out.write(inText.data(), inText.length());
+  }
+  Report(inName + " serial", inText, serial.str(), clock_type::now() - start,
+         inCompression);
+
+  uint32 maxThreads = boost::thread::hardware_concurrency();
+  if (maxThreads < 1)
+    maxThreads = 1;
+
+  for (uint32 threads = 1; ; threads *= 2)
+  {
+    if (threads > maxThreads)
+      threads = maxThreads;
+
+    MScheduler scheduler(threads);
+
+    std::ostringstream blocked;
+    start = clock_type::now();
+    {
+      io::filtering_stream<io::output> out;
+      out.push(MBlockCompressor(blocked, inCompression, scheduler));
+      out.write(inText.data(), inText.length());
+    }
+    Report((boost::format("%s blocks, %d thread%s") % inName % threads
+              % (threads > 1 ? "s" : "")).str(),
+           inText, blocked.str(), clock_type::now() - start, inCompression);
+
+    if (threads == maxThreads)
+      break;
+  }
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  std::string file = argc > 1 ? argv[1] : "test-data/small.sto";
+  size_t size = (argc > 2 ? std::stoul(argv[2]) : 32) * 1000 * 1000;
+
+  std::ifstream in(file, std::ios::binary);
+  if (not in.is_open())
+  {
+    std::cerr << "Could not open " << file << std::endl;
+    return 1;
+  }
+
+  std::ostringstream contents;
+  contents << in.rdbuf();
+  std::string sample = contents.str(), text;
+  if (sample.empty())
+  {
+    std::cerr << file << " is empty" << std::endl;
+    return 1;
+  }
+
+  text.reserve(size + sample.length());
+  while (text.length() < size)
+    text += sample;
+
+  std::cout << boost::format("%d bytes of %s") % text.length() % file << std::endl;
+
+  Bench(text, eCompressGZip, "gzip");
+  Bench(text, eCompressBZip2, "bzip2");
+
+  return 0;
+}
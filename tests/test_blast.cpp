@@ -0,0 +1,150 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE Blast
+
+#include "blast.h"
+#include "scheduler.h"
+
+#include <boost/filesystem/fstream.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <random>
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+
+const char kAminoAcids[] = "ACDEFGHIKLMNPQRSTVWY";
+const uint32 kHomologs = 6, kFragments = 30;
+
+std::string RandomSequence(std::mt19937& inRandom, uint32 inLength)
+{
+  std::string result;
+  for (uint32 i = 0; i < inLength; ++i)
+    result += kAminoAcids[inRandom() % 20];
+  return result;
+}
+
+// A databank with a few close homologs of the query and many sequences that
+// only share a short stretch with it. The latter are found by the search but
+// do not pass a strict expect value cut off.
+class blast_fixture
+{
+  public:
+    blast_fixture()
+      : m_databank(fs::temp_directory_path() / fs::unique_path("test-blast-%%%%-%%%%.fa"))
+    {
+      std::mt19937 random(42);
+
+      m_query = RandomSequence(random, 150);
+
+      fs::ofstream out(m_databank);
+
+      for (uint32 i = 0; i < kHomologs; ++i)
+      {
+        std::string seq = m_query;
+        for (uint32 j = i; j < seq.length(); j += 10)
+          seq[j] = kAminoAcids[random() % 20];
+        out << ">homolog-" << i << " close homolog" << std::endl
+            << seq << std::endl;
+      }
+
+      for (uint32 i = 0; i < kFragments; ++i)
+      {
+        std::string seq = RandomSequence(random, 150);
+        seq.replace(60, 14, m_query.substr(5 * i % 120, 14));
+        out << ">fragment-" << i << std::endl
+            << seq << std::endl;
+      }
+    }
+
+    ~blast_fixture()
+    {
+      fs::remove(m_databank);
+    }
+
+    bool Search(std::vector<BlastHit>& outHits, double inExpect,
+                uint32 inSampleSize, uint32 inThreads)
+    {
+      MScheduler scheduler(inThreads);
+      std::vector<fs::path> databanks(1, m_databank);
+
+      return SearchForHits(outHits, databanks, m_query, "blastp", "BLOSUM62",
+        3, inExpect, true, true, -1, -1, 0, inSampleSize, 0, scheduler);
+    }
+
+    fs::path m_databank;
+    std::string m_query;
+};
+
+void CheckSameHits(const std::vector<BlastHit>& inA,
+                   const std::vector<BlastHit>& inB)
+{
+  BOOST_REQUIRE_EQUAL(inA.size(), inB.size());
+  for (size_t i = 0; i < inA.size(); ++i)
+  {
+    BOOST_CHECK_EQUAL(inA[i].id, inB[i].id);
+    BOOST_CHECK_EQUAL(inA[i].def, inB[i].def);
+    BOOST_CHECK(inA[i].seq == inB[i].seq);
+    BOOST_CHECK_EQUAL(inA[i].query_start, inB[i].query_start);
+    BOOST_CHECK_EQUAL(inA[i].query_end, inB[i].query_end);
+    BOOST_CHECK_EQUAL(inA[i].target_start, inB[i].target_start);
+    BOOST_CHECK_EQUAL(inA[i].target_end, inB[i].target_end);
+    BOOST_CHECK_EQUAL(inA[i].identities, inB[i].identities);
+    BOOST_CHECK_EQUAL(inA[i].length, inB[i].length);
+  }
+}
+
+}
+
+BOOST_FIXTURE_TEST_SUITE(test_blast_suite, blast_fixture)
+
+BOOST_AUTO_TEST_CASE(samples_only_hits_passing_the_expect_cut_off)
+{
+  const double kStrict = 1e-20;
+  const uint32 kSampleSize = 10;
+
+  // more hits than the sample size are found with a lenient cut off
+  std::vector<BlastHit> found;
+  Search(found, 10, 0, 1);
+  BOOST_REQUIRE_GT(found.size(), kSampleSize);
+
+  // but only the homologs pass the strict one
+  std::vector<BlastHit> expected;
+  BOOST_CHECK(not Search(expected, kStrict, 0, 1));
+  BOOST_REQUIRE_EQUAL(expected.size(), kHomologs);
+
+  for (uint32 threads : { 1, 3 })
+  {
+    std::vector<BlastHit> hits;
+    BOOST_CHECK(not Search(hits, kStrict, kSampleSize, threads));
+    CheckSameHits(hits, expected);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(samples_the_same_hits_for_any_number_of_threads)
+{
+  const double kStrict = 1e-20;
+  const uint32 kSampleSize = 4;
+
+  std::vector<BlastHit> all;
+  Search(all, kStrict, 0, 1);
+
+  std::vector<BlastHit> sample;
+  BOOST_CHECK(Search(sample, kStrict, kSampleSize, 1));
+  BOOST_REQUIRE_EQUAL(sample.size(), kSampleSize);
+
+  for (const BlastHit& hit : sample)
+  {
+    BOOST_CHECK(std::find_if(all.begin(), all.end(), [&hit](const BlastHit& h) {
+      return h.id == hit.id;
+    }) != all.end());
+  }
+
+  std::vector<BlastHit> hits;
+  BOOST_CHECK(Search(hits, kStrict, kSampleSize, 3));
+  CheckSameHits(hits, sample);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
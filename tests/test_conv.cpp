@@ -1,11 +1,23 @@
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE Convert
 
+#include <boost/format.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
 #include <boost/test/unit_test.hpp>
 #include <sstream>
 #include <fstream>
 
+#include "block-compressor.h"
 #include "hssp-convert-3to1.h"
+#include "hssp-nt.h"
+#include "line-buffer.h"
+#include "scheduler.h"
+#include "structure.h"
 #include "utils.h"
 
 BOOST_AUTO_TEST_SUITE(test_hsspconv_suite)
@@ -25,4 +37,166 @@ BOOST_AUTO_TEST_CASE(test_conv_4s1h)
     in.close();
 }
 
+BOOST_AUTO_TEST_CASE(test_conv_small)
+{
+    std::ifstream in("test-data/small.sto"), expected("test-data/small.hssp");
+    BOOST_REQUIRE(in.is_open() and expected.is_open());
+
+    std::stringstream out;
+    ConvertHsspFile(in, out);
+
+    // the first line carries the package version
+    std::string line, expectedLine;
+    std::getline(out, line);
+    std::getline(expected, expectedLine);
+
+    uint32 lineNr = 1;
+    while (std::getline(expected, expectedLine))
+    {
+        ++lineNr;
+        BOOST_REQUIRE_MESSAGE(std::getline(out, line), "output ends at line " << lineNr);
+        BOOST_CHECK_MESSAGE(line == expectedLine, "line " << lineNr << " differs: '" << line << "'");
+    }
+    BOOST_CHECK(not std::getline(out, line));
+}
+
+// test-data/profile.sto was written by mkhssp for test-data/profile.pdb with
+// test-data/profile.fa as databank, before the Stockholm output was
+// rewritten.
+BOOST_AUTO_TEST_CASE(test_stockholm_small)
+{
+    std::ifstream in("test-data/profile.pdb"), expected("test-data/profile.sto");
+    BOOST_REQUIRE(in.is_open() and expected.is_open());
+
+    std::vector<boost::filesystem::path> databanks(1, "test-data/profile.fa");
+
+    for (uint32 threads : { 1, 3 })
+    {
+        MScheduler scheduler(threads);
+
+        in.clear();
+        in.seekg(0);
+        MProtein protein;
+        protein.ReadPDB(in);
+        protein.CalculateSecondaryStructure(scheduler);
+
+        std::stringstream out;
+        HSSP::CreateHSSP(protein, databanks, 5000, 25, 30, 2, HSSP::kThreshold,
+            HSSP::kFragmentCutOff, scheduler, 2 * threads, 0, 0, 0, false, out);
+
+        expected.clear();
+        expected.seekg(0);
+
+        std::string line, expectedLine;
+        uint32 lineNr = 0;
+        while (std::getline(expected, expectedLine))
+        {
+            ++lineNr;
+            BOOST_REQUIRE_MESSAGE(std::getline(out, line), "output ends at line " << lineNr);
+
+            // the second line carries the date
+            if (lineNr == 2)
+                continue;
+
+            BOOST_CHECK_MESSAGE(line == expectedLine, "line " << lineNr << " differs: '" << line << "'");
+        }
+        BOOST_CHECK(not std::getline(out, line));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_line_buffer)
+{
+    const int64 numbers[] = { 0, 7, -12, 99, 1234, 12345, 123456, -98765, 1234567890123LL };
+    const std::string strings[] = { "", "A", "AB", "ABCD", "ABCDEFGHIJKL" };
+    const double reals[] = { 0, 0.125, 0.5, 1, 2.9955, -0.004, 0.995, 12345.678 };
+
+    MLineBuffer line;
+    for (uint32 width = 1; width <= 10; ++width)
+    {
+        std::string fd = (boost::format("%%%d.%dd") % width % width).str(),
+                    fs = (boost::format("%%%d.%ds") % width % width).str();
+
+        for (int64 n : numbers)
+        {
+            line.clear();
+            BOOST_CHECK_EQUAL(line.Right(n, width).str(), (boost::format(fd) % n).str());
+        }
+
+        for (const std::string& s : strings)
+        {
+            line.clear();
+            BOOST_CHECK_EQUAL(line.Right(s, width).str(), (boost::format(fs) % s).str());
+
+            line.clear();
+            std::string clipped = s.length() > width ?
+                std::string(width - 1, '-') + '>' : std::string(width - s.length(), ' ') + s;
+            BOOST_CHECK_EQUAL(line.Clipped(s, width).str(), clipped);
+        }
+
+        for (uint32 precision = 0; precision < width; ++precision)
+        {
+            std::string ff = (boost::format("%%%d.%df") % width % precision).str();
+            for (double r : reals)
+            {
+                line.clear();
+                BOOST_CHECK_EQUAL(line.Fixed(r, width, precision).str(), (boost::format(ff) % r).str());
+                line.clear();
+                BOOST_CHECK_EQUAL(line.Fixed(float(r), width, precision).str(), (boost::format(ff) % float(r)).str());
+            }
+        }
+    }
+
+    std::ostringstream os;
+    line.clear();
+    line.Append("#=GF RI ").Clipped(1234567, 5).Append(' ').Right(42, 5);
+    line.Write(os);
+    BOOST_CHECK_EQUAL(os.str(), "#=GF RI ---->    42\n");
+    BOOST_CHECK(line.str().empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_block_compressor)
+{
+    namespace io = boost::iostreams;
+
+    std::ifstream in("test-data/small.sto");
+    std::ostringstream sample;
+    sample << in.rdbuf();
+
+    // empty, less than one block, and a few gzip blocks plus a partial one
+    std::string text;
+    while (text.length() < 3 * MBlockCompressor::BlockSize(eCompressGZip) + 1000)
+        text += sample.str();
+    const std::string texts[] = { "", sample.str(), text };
+
+    for (MCompression compression : { eCompressGZip, eCompressBZip2 })
+    {
+        for (uint32 threads : { 1, 3 })
+        {
+            MScheduler scheduler(threads);
+
+            for (const std::string& t : texts)
+            {
+                std::ostringstream compressed;
+                {
+                    io::filtering_stream<io::output> out;
+                    out.push(MBlockCompressor(compressed, compression, scheduler));
+                    out << t;
+                }
+
+                std::string data = compressed.str(), result;
+                io::filtering_stream<io::input> in;
+                if (compression == eCompressGZip)
+                    in.push(io::gzip_decompressor());
+                else
+                    in.push(io::bzip2_decompressor());
+                in.push(io::array_source(data.data(), data.length()));
+                io::copy(in, io::back_inserter(result));
+
+                BOOST_CHECK(not data.empty());
+                BOOST_CHECK(result == t);
+            }
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
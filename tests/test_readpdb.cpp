@@ -1,10 +1,14 @@
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE ReadPDB
 
+#include "iocif.h"
+#include "scheduler.h"
 #include "structure.h"
 
+#include <boost/format.hpp>
 #include <boost/test/unit_test.hpp>
 
+#include <random>
 #include <sstream>
 
 namespace hssp { namespace test { } }
@@ -56,6 +60,146 @@ namespace hssp {
         BOOST_REQUIRE_NO_THROW( argProtein.GetResidue( argChainID, argSeqNumber, argInsertionCode )            );
         BOOST_CHECK           ( argProtein.GetResidue( argChainID, argSeqNumber, argInsertionCode ) != nullptr );
       }
+
+      /// \brief Build PDB data for chains of backbone atoms following a random walk through a small box
+      ///
+      /// The box is crowded, so there are many H-bond candidates, including atoms that nearly collide.
+      static string makeCrowdedPDB(const uint32 &argNrOfChains,   ///< The number of chains
+                                   const uint32 &argChainLength,  ///< The number of residues per chain
+                                   const uint32 &argSeed          ///< The seed for the random walk
+                                   ) {
+        std::mt19937 theGenerator( argSeed );
+        std::uniform_real_distribution<double> theDistribution( -1.0, 1.0 );
+        auto theOffset = [&] (const double &argLength) {
+          double theX, theY, theZ, theLength;
+          do {
+            theX = theDistribution( theGenerator );
+            theY = theDistribution( theGenerator );
+            theZ = theDistribution( theGenerator );
+            theLength = std::sqrt( theX * theX + theY * theY + theZ * theZ );
+          } while ( theLength < 0.1 || theLength > 1.0 );
+          return MPoint( theX, theY, theZ ) * ( argLength / theLength );
+        };
+
+        const double theBoxSize = 20.0;
+        std::ostringstream thePDB;
+        uint32 theSerial = 1;
+        for (uint32 theChain = 0; theChain < argNrOfChains; ++theChain) {
+          MPoint theCAlpha( 0, 0, 0 );
+          for (uint32 theResidue = 1; theResidue <= argChainLength; ++theResidue) {
+            const MPoint theN = theCAlpha + theOffset( 1.46 );
+            const MPoint theC = theCAlpha + theOffset( 1.52 );
+            const MPoint theO = theC + theOffset( 1.23 );
+            const MPoint theAtoms[] = { theN, theCAlpha, theC, theO };
+            const char * const theNames[] = { " N  ", " CA ", " C  ", " O  " };
+            for (uint32 theAtom = 0; theAtom < 4; ++theAtom) {
+              thePDB << boost::format( "ATOM  %5d %4s ALA %c%4d    %8.3f%8.3f%8.3f  1.00  0.00           %c  \n" )
+                % theSerial++ % theNames[ theAtom ] % char( 'A' + theChain ) % theResidue
+                % theAtoms[ theAtom ].mX % theAtoms[ theAtom ].mY % theAtoms[ theAtom ].mZ % theNames[ theAtom ][ 1 ];
+            }
+
+            // step to the next C-alpha, turning back into the box
+            MPoint theNext = theCAlpha + theOffset( 3.8 );
+            while ( std::abs( theNext.mX ) > theBoxSize || std::abs( theNext.mY ) > theBoxSize || std::abs( theNext.mZ ) > theBoxSize ) {
+              theNext = theCAlpha + theOffset( 3.8 );
+            }
+            theCAlpha = theNext;
+          }
+        }
+        return thePDB.str();
+      }
+
+      /// \brief Perform Boost Test assertions that the H-bonds stored in the residues are those of a serial scan over all pairs
+      static void checkHBondsMatchPairScan(const MProtein &argProtein ///< The protein after its secondary structure was calculated
+                                           ) {
+        std::vector<MResidue *> theResidues;
+        for (const MChain * const theChain : argProtein.GetChains()) {
+          theResidues.insert( theResidues.end(), theChain->GetResidues().begin(), theChain->GetResidues().end() );
+        }
+
+        // the two best bonds, a bond only replaces one that is strictly worse
+        auto theStore = [] (std::vector<HBond> &argBonds, MResidue * const argPartner, const double &argEnergy) {
+          if ( argEnergy < argBonds[ 0 ].energy ) {
+            argBonds[ 1 ] = argBonds[ 0 ];
+            argBonds[ 0 ] = HBond{ argPartner, argEnergy };
+          }
+          else if ( argEnergy < argBonds[ 1 ].energy ) {
+            argBonds[ 1 ] = HBond{ argPartner, argEnergy };
+          }
+        };
+
+        const std::vector<HBond> theNoBonds( 2, HBond{ nullptr, 0 } );
+        std::vector<std::vector<HBond>> theAcceptors( theResidues.size(), theNoBonds );
+        std::vector<std::vector<HBond>> theDonors   ( theResidues.size(), theNoBonds );
+        for (uint32 i = 0; i < theResidues.size(); ++i) {
+          for (uint32 j = i + 1; j < theResidues.size(); ++j) {
+            if ( Distance( theResidues[ i ]->GetCAlpha(), theResidues[ j ]->GetCAlpha() ) >= 9.0 ) {
+              continue;
+            }
+            const double theEnergy = MResidue::HBondEnergy( *theResidues[ i ], *theResidues[ j ] );
+            theStore( theAcceptors[ i ], theResidues[ j ], theEnergy );
+            theStore( theDonors   [ j ], theResidues[ i ], theEnergy );
+            if ( j != i + 1 ) {
+              const double theReverseEnergy = MResidue::HBondEnergy( *theResidues[ j ], *theResidues[ i ] );
+              theStore( theAcceptors[ j ], theResidues[ i ], theReverseEnergy );
+              theStore( theDonors   [ i ], theResidues[ j ], theReverseEnergy );
+            }
+          }
+        }
+
+        for (uint32 i = 0; i < theResidues.size(); ++i) {
+          const MResidue &theResidue = *theResidues[ i ];
+          for (uint32 k = 0; k < 2; ++k) {
+            BOOST_CHECK( theResidue.Acceptor()[ k ].residue == theAcceptors[ i ][ k ].residue );
+            BOOST_CHECK_EQUAL( theResidue.Acceptor()[ k ].energy, theAcceptors[ i ][ k ].energy );
+            BOOST_CHECK( theResidue.Donor()[ k ].residue == theDonors[ i ][ k ].residue );
+            BOOST_CHECK_EQUAL( theResidue.Donor()[ k ].energy, theDonors[ i ][ k ].energy );
+          }
+        }
+      }
+
+      /// \brief Get the rows of an mmCIF record as lists of name=value strings
+      static std::vector<std::vector<string>> getCifRows(const mmCIF::record &argRecord ///< The record to read
+                                                         ) {
+        std::vector<std::vector<string>> theRows;
+        for (const mmCIF::row &theRow : argRecord) {
+          std::vector<string> theFields;
+          for (const mmCIF::field &theField : theRow.m_fields) {
+            theFields.push_back( theField.name() + "=" + theField.value() );
+          }
+          theRows.push_back( theFields );
+        }
+        return theRows;
+      }
+
+      /// \brief Perform Boost Test assertions that streaming the _atom_site rows of mmCIF data gives what the buffered parser reads
+      ///
+      /// Tiny batch sizes make nearly every line end a batch, so rows spread over several lines are cut off
+      /// and carried over into the next batch.
+      static void checkStreamedCifMatchesBuffered(const string              &argCif,       ///< The mmCIF data
+                                                  const std::vector<string> &argCategories ///< The categories to keep
+                                                  ) {
+        istringstream theBufferedSS{ argCif };
+        const mmCIF::file theBuffered( theBufferedSS );
+        const std::vector<std::vector<string>> theAtomSites = getCifRows( theBuffered[ "_atom_site" ] );
+        BOOST_REQUIRE( ! theAtomSites.empty() );
+
+        for (const size_t &theBatchSize : { size_t( 1 ), size_t( 7 ), size_t( 100 ), size_t( 1024 * 1024 ) }) {
+          BOOST_TEST_MESSAGE( "batch size " << theBatchSize );
+
+          std::vector<std::vector<string>> theStreamed;
+          istringstream theStreamedSS{ argCif };
+          const mmCIF::file theFile( theStreamedSS, argCategories, "_atom_site", [&] (const mmCIF::record &argRows) {
+            const std::vector<std::vector<string>> theRows = getCifRows( argRows );
+            theStreamed.insert( theStreamed.end(), theRows.begin(), theRows.end() );
+          }, theBatchSize );
+
+          BOOST_CHECK( theStreamed == theAtomSites );
+          for (const string &theCategory : argCategories) {
+            BOOST_CHECK( getCifRows( theFile[ theCategory.c_str() ] ) == getCifRows( theBuffered[ theCategory.c_str() ] ) );
+          }
+        }
+      }
     };
 
   }
@@ -145,4 +289,198 @@ ATOM   1095  O   ARG A 125      28.075   2.852  -8.074  1.00 10.39           O
 
 
 
+// The lines are read from a buffer that is refilled from the stream, atom
+// records must survive crossing the end of the buffer, as must a last line
+// without a newline.
+BOOST_AUTO_TEST_CASE(parses_atoms_across_buffer_refills)
+{
+  // Given: well over a megabyte of atom records, without the final newline
+  string theData = makeCrowdedPDB( 4, 1200, 17 );
+  BOOST_REQUIRE_GT( theData.length(), size_t(1024 * 1024) );
+  theData.erase( theData.length() - 1 );
+  istringstream raw_pdb_data_ss{ theData };
+
+  // When: parsing the data into a MProtein
+  const MProtein theProtein = ReadPDBIntoMProtein( raw_pdb_data_ss );
+
+  // Then: all residues are there, including the last one
+  BOOST_CHECK_EQUAL( theProtein.GetChains().size(), size_t(4) );
+  BOOST_CHECK_EQUAL( theProtein.GetChains().back()->GetResidues().size(), size_t(1200) );
+  checkResidueIsPresent( theProtein, "A", 1 );
+  checkResidueIsPresent( theProtein, "D", 1200 );
+  BOOST_CHECK_EQUAL( theProtein.GetResidue( "D", 1200, " " )->GetCAlpha().mSerial, uint32(4 * 1200 * 4 - 2) );
+}
+
+
+
+// ReadmmCIF looks up the columns of _atom_site once, by name, so their order
+// must not matter. Quoted values lose their quotes.
+BOOST_AUTO_TEST_CASE(reads_mmcif_atom_site_columns_by_name)
+{
+  // Given: this raw mmCIF data, with the columns in an unusual order and a second model
+  istringstream raw_cif_data_ss{ R"(data_TEST
+_entry.id TEST
+_struct_keywords.text 'TEST'
+loop_
+_atom_site.Cartn_z
+_atom_site.id
+_atom_site.auth_atom_id
+_atom_site.label_alt_id
+_atom_site.auth_comp_id
+_atom_site.label_asym_id
+_atom_site.auth_asym_id
+_atom_site.label_seq_id
+_atom_site.auth_seq_id
+_atom_site.pdbx_PDB_ins_code
+_atom_site.Cartn_x
+_atom_site.Cartn_y
+_atom_site.occupancy
+_atom_site.B_iso_or_equiv
+_atom_site.type_symbol
+_atom_site.pdbx_formal_charge
+_atom_site.pdbx_PDB_model_num
+-37.532  1 N    . PRO A X 1 11 ? 3.069 2.269 1.00 45.60 N ? 1
+-36.447  2 CA   . PRO A X 1 11 ? 3.988 2.650 1.00 44.31 C ? 1
+-35.194  3 C    . PRO A X 1 11 ? 3.746 1.828 1.00 38.99 C ? 1
+-35.069  4 O    . PRO A X 1 11 ? 2.578 1.409 1.00 44.26 O ? 1
+-34.283  8 N    . PRO A X 2 12 ? 4.679 1.563 1.00 33.16 N ? 1
+-33.032  9 CA   . PRO A X 2 12 ? 4.222 0.910 1.00 28.69 C ? 1
+-32.357 10 C    . PRO A X 2 12 ? 3.183 1.806 1.00 24.26 C ? 1
+-32.488 11 O    . PRO A X 2 12 ? 3.215 3.030 1.00 26.34 O ? 1
+-32.000 12 'CB' . PRO A X 2 12 ? 5.215 1.030 1.00 26.34 C -1 1
+-32.000 13 HA   . PRO A X 2 12 ? 5.215 1.030 1.00 26.34 H ? 1
+-30.986 16 CA   . GLY A X 3 13 ? 1.219 1.833 1.00 17.75 C ? 2
+)" };
+
+  // When: parsing the data into a MProtein
+  MProtein theProtein;
+  theProtein.ReadmmCIF( raw_cif_data_ss );
+
+  // Then: both residues of the first model are there, with their atoms
+  BOOST_CHECK_EQUAL( getNrOfResidues( theProtein ), unsigned(2) );
+  checkResidueIsPresent( theProtein, "A", 11, "" );
+  checkResidueIsPresent( theProtein, "A", 12, "" );
+  BOOST_CHECK_THROW( theProtein.GetResidue( "A", 13, "" ), std::exception );
+
+  const MResidue &theResidue = *theProtein.GetResidue( "A", 12, "" );
+  BOOST_CHECK_EQUAL( theResidue.GetCAlpha().mSerial, uint32(9) );
+  BOOST_CHECK_SMALL( theResidue.GetCAlpha().mLoc.mZ + 33.032, 1e-9 );
+  BOOST_CHECK_EQUAL( theResidue.GetCAlpha().GetAuthChainID(), "X" );
+  BOOST_REQUIRE_EQUAL( theResidue.GetSideChain().size(), 1 );
+  BOOST_CHECK_EQUAL( theResidue.GetSideChain().front().GetName(), "CB" );
+  BOOST_CHECK_EQUAL( int(theResidue.GetSideChain().front().mCharge), -1 );
+}
+
+
+
+// ReadmmCIF streams the _atom_site rows in batches while the file is read.
+// Text fields may contain lines that look like loop_, data_ or names, rows
+// may be spread over several lines and there may be comments between them.
+BOOST_AUTO_TEST_CASE(streams_mmcif_atom_sites_like_the_buffered_parser)
+{
+  checkStreamedCifMatchesBuffered( R"(data_TEST
+#
+_entry.id   TEST
+#
+_struct_keywords.entry_id TEST
+_struct_keywords.text     'HYDROLASE, loop_ in quotes'
+#
+loop_
+_entity.id
+_entity.pdbx_description
+1
+;A text field with
+loop_
+_atom_site.id 1
+data_bogus
+;
+2 WATER
+#
+loop_
+_atom_site.group_PDB
+_atom_site.id
+_atom_site.label_atom_id
+_atom_site.label_comp_id
+_atom_site.label_asym_id
+_atom_site.Cartn_x
+_atom_site.Cartn_y
+_atom_site.Cartn_z
+_atom_site.pdbx_PDB_model_num
+ATOM 1 N   PRO A 3.069 2.269 -37.532 1
+ATOM 2 CA  PRO A
+3.988 2.650
+-36.447 1
+# a comment between the rows
+ATOM 3 C
+PRO A 3.746 1.828 -35.194 1
+ATOM 4 "O" 'PRO' A 2.578 1.409 -35.069 1
+   # an indented comment
+HETATM 5 O
+;a text value over several lines
+loop_
+data_more
+_atom_site.id 6
+;
+A 0.000 0.000 0.000 1
+ATOM 6 CB PRO A 5.215 1.030 -32.000 1
+#
+loop_
+_pdbx_struct_oper_list.id
+_pdbx_struct_oper_list.type
+1 'identity operation'
+2
+;a text field
+_atom_site.id 7
+;
+#
+_struct.entry_id TEST
+_struct.title    'A category after the atom sites'
+)", { "_entity", "_entry", "_pdbx_struct_oper_list", "_struct", "_struct_keywords" } );
+}
+
+// A single atom site is written as items instead of as a loop.
+BOOST_AUTO_TEST_CASE(streams_single_row_mmcif_atom_site_written_as_items)
+{
+  checkStreamedCifMatchesBuffered( R"(data_ONE
+_entry.id ONE
+#
+_atom_site.group_PDB ATOM
+_atom_site.id        1
+_atom_site.label_atom_id CA
+_atom_site.label_comp_id GLY
+_atom_site.label_asym_id A
+_atom_site.Cartn_x   1.000
+_atom_site.Cartn_y
+;2.000
+;
+_atom_site.Cartn_z   3.000
+#
+_struct.title 'after'
+)", { "_entry", "_struct" } );
+}
+
+
+
+// The H-bond energies are calculated for blocks of acceptors at a time, on
+// several threads. The bonds must be exactly those of the plain scan over
+// all pairs of residues.
+BOOST_AUTO_TEST_CASE(hbonds_match_serial_pair_scan)
+{
+  for (const uint32 &theThreads : { 1u, 4u }) {
+    // Given: crowded chains of backbone atoms
+    istringstream raw_pdb_data_ss{ makeCrowdedPDB( 3, 120, 42 + theThreads ) };
+    MProtein theProtein = ReadPDBIntoMProtein( raw_pdb_data_ss );
+
+    // When: calculating the secondary structure
+    MScheduler theScheduler( theThreads );
+    theProtein.CalculateSecondaryStructure( theScheduler );
+
+    // Then: the H-bonds are those of the pair scan
+    BOOST_CHECK_GT( getNrOfResidues( theProtein ), unsigned(300) );
+    checkHBondsMatchPairScan( theProtein );
+  }
+}
+
+
+
 BOOST_AUTO_TEST_SUITE_END()